@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+
+// Native generator of the test files, a faster generator.py with more
+// shapes of data. The format is the same: numbers separated by one space,
+// no trailing space.
+//
+// Build: gcc -O2 gen.c -o gen -lm
+
+#define BUFFER_SIZE (1 << 20)
+#define DEFAULT_FEW_COUNT 16
+#define DEFAULT_ZIPF_COUNT 1000
+
+typedef enum {
+    DIST_UNIFORM,
+    DIST_SORTED,
+    DIST_REVERSED,
+    DIST_EQUAL,
+    DIST_FEW,
+    DIST_ZIPF,
+    DIST_ORGAN,
+    DIST_COUNT,
+} Dist_t;
+
+static const char *g_distNames[DIST_COUNT] = {
+    "uniform", "sorted", "reversed", "equal", "few", "zipf", "organ",
+};
+
+static const char *g_fileName = NULL;
+static long long g_count = -1;
+// main.c reads the numbers as int
+static long long g_max = INT_MAX;
+static Dist_t g_dist = DIST_UNIFORM;
+static int g_uniqueCount = 0;
+static double g_zipfExponent = 1.0;
+static uint64_t g_seed = 0;
+
+static uint64_t g_rngState;
+
+// splitmix64
+static uint64_t rngNext(void)
+{
+    uint64_t z = (g_rngState += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, bound), bound is at most 2^32.
+static uint64_t rngBelow(uint64_t bound)
+{
+    return ((rngNext() >> 32) * bound) >> 32;
+}
+
+static double rngDouble(void)
+{
+    return (rngNext() >> 11) * (1.0 / (1ULL << 53));
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s -f file -c count [-m max] [-d dist] "
+            "[-k unique] [-z exponent] [-s seed]\n", name);
+    fprintf(stderr, "dist is one of:");
+    for (int i = 0; i < DIST_COUNT; ++i) {
+        fprintf(stderr, " %s", g_distNames[i]);
+    }
+    fprintf(stderr, "\n");
+}
+
+static int parseArgs(int argc, char **argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "f:c:m:d:k:z:s:")) != -1) {
+        switch (c) {
+            case 'f':
+                g_fileName = optarg;
+                break;
+            case 'c':
+                g_count = atoll(optarg);
+                break;
+            case 'm':
+                g_max = atoll(optarg);
+                break;
+            case 'd':
+                g_dist = DIST_COUNT;
+                for (int i = 0; i < DIST_COUNT; ++i) {
+                    if (strcmp(optarg, g_distNames[i]) == 0) {
+                        g_dist = i;
+                    }
+                }
+                if (g_dist == DIST_COUNT) {
+                    fprintf(stderr, "Unknown distribution %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'k':
+                g_uniqueCount = atoi(optarg);
+                break;
+            case 'z':
+                g_zipfExponent = atof(optarg);
+                break;
+            case 's':
+                g_seed = strtoull(optarg, NULL, 10);
+                break;
+            case '?':
+                return 1;
+            default:
+                abort();
+        }
+    }
+    if (g_fileName == NULL || g_count < 0) {
+        return 1;
+    }
+    if (g_max < 0 || g_max > INT_MAX) {
+        fprintf(stderr, "Max must be in [0, %d].\n", INT_MAX);
+        return 1;
+    }
+    if (g_uniqueCount < 0 || g_zipfExponent <= 0) {
+        fprintf(stderr, "Bad unique count or zipf exponent.\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Value of a point of the line from 0 at pos = 0 to max at pos = len.
+static int lineValue(long long pos, long long len)
+{
+    if (len == 0) {
+        return g_max;
+    }
+    return (int)((unsigned __int128)pos * g_max / len);
+}
+
+typedef struct {
+    char *data;
+    size_t size;
+    FILE *file;
+} Output_t;
+
+static int outputFlush(Output_t *out)
+{
+    if (fwrite(out->data, 1, out->size, out->file) != out->size) {
+        perror(g_fileName);
+        return 1;
+    }
+    out->size = 0;
+    return 0;
+}
+
+static int outputNumber(Output_t *out, int value, bool isFirst)
+{
+    // Room for a separator and the longest int
+    if (out->size + 16 > BUFFER_SIZE && outputFlush(out) != 0) {
+        return 1;
+    }
+    if (!isFirst) {
+        out->data[out->size++] = ' ';
+    }
+    char digits[16];
+    int len = 0;
+    unsigned v = value;
+    do {
+        digits[len++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+    while (len > 0) {
+        out->data[out->size++] = digits[--len];
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (parseArgs(argc, argv) != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    g_rngState = g_seed != 0 ? g_seed : (uint64_t)time(NULL) ^ (uint64_t)clock();
+
+    // few and zipf pick from a table of random values, zipf by the
+    // cumulative weights of the ranks
+    int tableSize = 0;
+    if (g_dist == DIST_FEW) {
+        tableSize = g_uniqueCount > 0 ? g_uniqueCount : DEFAULT_FEW_COUNT;
+    } else if (g_dist == DIST_ZIPF) {
+        tableSize = g_uniqueCount > 0 ? g_uniqueCount : DEFAULT_ZIPF_COUNT;
+    } else if (g_dist == DIST_EQUAL) {
+        tableSize = 1;
+    }
+    int *table = NULL;
+    double *cdf = NULL;
+    if (tableSize > 0) {
+        table = malloc(tableSize * sizeof(int));
+        for (int i = 0; i < tableSize; ++i) {
+            table[i] = rngBelow(g_max + 1);
+        }
+    }
+    if (g_dist == DIST_ZIPF) {
+        cdf = malloc(tableSize * sizeof(double));
+        double sum = 0;
+        for (int i = 0; i < tableSize; ++i) {
+            sum += 1.0 / pow(i + 1, g_zipfExponent);
+            cdf[i] = sum;
+        }
+        for (int i = 0; i < tableSize; ++i) {
+            cdf[i] /= sum;
+        }
+    }
+
+    Output_t out = {0};
+    out.file = fopen(g_fileName, "w");
+    if (out.file == NULL) {
+        perror(g_fileName);
+        return 1;
+    }
+    out.data = malloc(BUFFER_SIZE);
+    int rc = 0;
+    long long half = g_count / 2;
+    for (long long i = 0; i < g_count && rc == 0; ++i) {
+        int value;
+        switch (g_dist) {
+            case DIST_UNIFORM:
+                value = rngBelow(g_max + 1);
+                break;
+            case DIST_SORTED:
+                value = lineValue(i, g_count - 1);
+                break;
+            case DIST_REVERSED:
+                value = lineValue(g_count - 1 - i, g_count - 1);
+                break;
+            case DIST_EQUAL:
+                value = table[0];
+                break;
+            case DIST_FEW:
+                value = table[rngBelow(tableSize)];
+                break;
+            case DIST_ZIPF: {
+                double u = rngDouble();
+                int l = 0, h = tableSize - 1;
+                while (l < h) {
+                    int m = (l + h) / 2;
+                    if (cdf[m] < u) {
+                        l = m + 1;
+                    } else {
+                        h = m;
+                    }
+                }
+                value = table[l];
+                break;
+            }
+            case DIST_ORGAN:
+                value = i < half ? lineValue(i, half) : lineValue(g_count - 1 - i, g_count - 1 - half);
+                break;
+            default:
+                abort();
+        }
+        rc = outputNumber(&out, value, i == 0);
+    }
+    if (rc == 0) {
+        rc = outputFlush(&out);
+    }
+    if (fclose(out.file) != 0 && rc == 0) {
+        perror(g_fileName);
+        rc = 1;
+    }
+    free(out.data);
+    free(table);
+    free(cdf);
+    return rc;
+}
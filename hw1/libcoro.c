@@ -5,6 +5,8 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
 #include "libcoro.h"
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
@@ -28,26 +30,38 @@ struct coro {
 	struct coro *next, *prev;
 };
 
+/*
+ * Scheduler state is per thread, so each thread can have its own
+ * scheduler and coroutines. A coroutine must be run by the thread
+ * which created it.
+ */
+
 /**
  * Scheduler is a main coroutine - it catches and returns dead
  * ones to a user.
  */
-static struct coro coro_sched;
+static __thread struct coro coro_sched;
 /**
  * True, if in that moment the scheduler is waiting for a
  * coroutine finish.
  */
-static bool is_sched_waiting = false;
+static __thread bool is_sched_waiting = false;
 /** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
+static __thread struct coro *coro_this_ptr = NULL;
 /** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+static __thread struct coro *coro_list = NULL;
 /**
  * Buffer, used by the coroutine constructor to escape from the
  * signal handler back into the constructor to rollback
  * sigaltstack etc.
  */
-static sigjmp_buf start_point;
+static __thread sigjmp_buf start_point;
+/**
+ * The signal handler is global for the process, so coroutines are
+ * created by one thread at a time. The section is short and does
+ * not sleep, a spinlock is enough.
+ */
+static atomic_flag coro_new_lock = ATOMIC_FLAG_INIT;
 
 /** Add a new coroutine to the beginning of the list. */
 static void
@@ -120,6 +134,22 @@ coro_yield(void)
 		coro_yield_to(to);
 }
 
+void
+coro_suspend(void)
+{
+	coro_yield_to(&coro_sched);
+}
+
+void
+coro_resume(struct coro *c)
+{
+	is_sched_waiting = true;
+	coro_yield_to(c);
+	is_sched_waiting = false;
+	if (c->is_finished)
+		coro_list_delete(c);
+}
+
 void
 coro_sched_init(void)
 {
@@ -200,6 +230,9 @@ coro_new(coro_f func, void *func_arg)
 	 * able to set a new handler.
 	 */
 	sigset_t news, olds, suss;
+	while (atomic_flag_test_and_set_explicit(&coro_new_lock,
+						 memory_order_acquire))
+		sched_yield();
 	sigemptyset(&news);
 	sigaddset(&news, SIGUSR2);
 	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
@@ -250,6 +283,7 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+	atomic_flag_clear_explicit(&coro_new_lock, memory_order_release);
 
 	/* Now scheduler can work with that coroutine. */
 	coro_list_add(c);
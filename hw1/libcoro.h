@@ -47,4 +47,17 @@ coro_delete(struct coro *c);
 void
 coro_yield(void);
 
+/**
+ * Run coroutine @a c until it suspends or finishes. Must be called
+ * by the scheduler, from the thread which created @a c. A finished
+ * coroutine is removed from the scheduler, so it is not returned
+ * by coro_sched_wait().
+ */
+void
+coro_resume(struct coro *c);
+
+/** Switch from the current coroutine back to the scheduler. */
+void
+coro_suspend(void);
+
 #endif /* LIBCORO_INCLUDED */
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <getopt.h>
+
+// Streaming checker of the sort result, a faster checker.py. The result
+// is read in chunks and checked to be not decreasing. If the input files
+// are given too, the result must hold the same numbers: their count, sum
+// and two sums of hashes are compared, which does not depend on the order
+// and takes constant memory.
+//
+// Build: gcc -O2 verify.c -o verify
+
+#define BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    FILE *file;
+    const char *name;
+    char *data;
+    size_t size;
+    size_t pos;
+    long long index;
+} Reader_t;
+
+// Multiset checksum, the same for any order of the numbers
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t hashSum1;
+    uint64_t hashSum2;
+} Checksum_t;
+
+static const char *g_resultName = NULL;
+
+static uint64_t mix(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void checksumAdd(Checksum_t *sum, long long value)
+{
+    ++sum->count;
+    sum->sum += value;
+    sum->hashSum1 += mix(value);
+    sum->hashSum2 += mix(value ^ 0x9e3779b97f4a7c15ULL);
+}
+
+static int readerOpen(Reader_t *reader, const char *name)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->name = name;
+    reader->file = fopen(name, "r");
+    if (reader->file == NULL) {
+        perror(name);
+        return 1;
+    }
+    reader->data = malloc(BUFFER_SIZE);
+    return 0;
+}
+
+static void readerClose(Reader_t *reader)
+{
+    fclose(reader->file);
+    free(reader->data);
+}
+
+// Next byte of the file, EOF at the end.
+static inline int readerByte(Reader_t *reader)
+{
+    if (reader->pos == reader->size) {
+        reader->size = fread(reader->data, 1, BUFFER_SIZE, reader->file);
+        reader->pos = 0;
+        if (reader->size == 0) {
+            return EOF;
+        }
+    }
+    return (unsigned char)reader->data[reader->pos++];
+}
+
+// Read the next number into value. Returns 1 on success, 0 at the end of
+// the file, -1 on a token which is not a number.
+static int readerNext(Reader_t *reader, long long *value)
+{
+    int c;
+    while ((c = readerByte(reader)) != EOF && isspace(c)) {
+    }
+    if (c == EOF) {
+        return 0;
+    }
+    ++reader->index;
+    bool isNegative = c == '-';
+    if (isNegative) {
+        c = readerByte(reader);
+    }
+    int digits = 0;
+    unsigned long long v = 0;
+    for (; c != EOF && isdigit(c); c = readerByte(reader), ++digits) {
+        v = v * 10 + (c - '0');
+    }
+    // A result of main.c is made of ints, 18 digits is plenty
+    if (digits == 0 || digits > 18 || (c != EOF && !isspace(c))) {
+        return -1;
+    }
+    *value = isNegative ? -(long long)v : (long long)v;
+    return 1;
+}
+
+static int readFile(const char *name, Checksum_t *sum, bool isOrdered)
+{
+    Reader_t reader;
+    if (readerOpen(&reader, name) != 0) {
+        return 1;
+    }
+    int rc, result = 0;
+    long long prev = 0, value;
+    while ((rc = readerNext(&reader, &value)) == 1) {
+        if (isOrdered && reader.index > 1 && value < prev) {
+            printf("Error on numbers %lld %lld at position %lld\n", prev, value, reader.index);
+            result = 1;
+            break;
+        }
+        prev = value;
+        checksumAdd(sum, value);
+    }
+    if (rc < 0) {
+        printf("Error: %s: bad number at position %lld\n", name, reader.index);
+        result = 1;
+    }
+    readerClose(&reader);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    bool isBadArgs = false;
+    while ((c = getopt(argc, argv, "f:")) != -1) {
+        if (c == 'f') {
+            g_resultName = optarg;
+        } else {
+            isBadArgs = true;
+        }
+    }
+    if (g_resultName == NULL || isBadArgs) {
+        fprintf(stderr, "usage: %s -f result [input...]\n", argv[0]);
+        return 1;
+    }
+    Checksum_t resultSum = {0};
+    if (readFile(g_resultName, &resultSum, true) != 0) {
+        return 1;
+    }
+    if (optind < argc) {
+        Checksum_t inputSum = {0};
+        for (int i = optind; i < argc; ++i) {
+            if (readFile(argv[i], &inputSum, false) != 0) {
+                return 1;
+            }
+        }
+        if (inputSum.count != resultSum.count) {
+            printf("Error: %llu numbers in the inputs, %llu in the result\n",
+                   (unsigned long long)inputSum.count, (unsigned long long)resultSum.count);
+            return 1;
+        }
+        if (memcmp(&inputSum, &resultSum, sizeof(inputSum)) != 0) {
+            printf("Error: the result is not the same numbers as the inputs\n");
+            return 1;
+        }
+    }
+    printf("All is ok\n");
+    return 0;
+}
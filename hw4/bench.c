@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include "thread_pool.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Thread pool benchmarks. Each measurement is printed as one JSON
+ * object per line, so runs before and after a change can be
+ * compared with any JSON tool. The only argument is a scale of
+ * the iteration counts, 1 by default.
+ */
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/** Sort @a samples and print their percentiles as JSON fields. */
+static void
+print_percentiles(uint64_t *samples, int count)
+{
+	qsort(samples, count, sizeof(*samples), cmp_u64);
+	printf("\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+	       "\"p999_ns\": %llu, \"max_ns\": %llu",
+	       (unsigned long long)samples[count / 2],
+	       (unsigned long long)samples[(int)(count * 0.9)],
+	       (unsigned long long)samples[(int)(count * 0.99)],
+	       (unsigned long long)samples[(int)(count * 0.999)],
+	       (unsigned long long)samples[count - 1]);
+}
+
+static struct thread_pool *
+pool_new(int thread_count)
+{
+	struct thread_pool *pool;
+	struct thread_pool_opts opts;
+	thread_pool_opts_create(&opts);
+	opts.max_thread_count = thread_count;
+	opts.idle_timeout = 0;
+	if (thread_pool_new_opts(&opts, &pool) != 0) {
+		fprintf(stderr, "can't create a pool of %d threads\n",
+			thread_count);
+		exit(1);
+	}
+	return pool;
+}
+
+static void *
+task_empty_f(void *arg)
+{
+	return arg;
+}
+
+/** Write the start time into the task argument. */
+static void *
+task_stamp_f(void *arg)
+{
+	*(uint64_t *)arg = now_ns();
+	return arg;
+}
+
+/**
+ * Empty tasks pushed in batches and joined, for several pool
+ * sizes. Measures pure push/pop/complete overhead.
+ */
+static void
+bench_throughput(int scale)
+{
+	enum { batch = 10000 };
+	int total = 200000 * scale;
+	struct thread_task **tasks = malloc(batch * sizeof(*tasks));
+	for (int i = 0; i < batch; ++i)
+		thread_task_new(&tasks[i], task_empty_f, NULL);
+	int max_threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_threads < 4)
+		max_threads = 4;
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		struct thread_pool *pool = pool_new(threads);
+		void *result;
+		uint64_t start = now_ns();
+		for (int done = 0; done < total; done += batch) {
+			for (int i = 0; i < batch; ++i)
+				thread_pool_push_task(pool, tasks[i]);
+			for (int i = 0; i < batch; ++i)
+				thread_task_join(tasks[i], &result);
+		}
+		double sec = (now_ns() - start) / 1e9;
+		printf("{\"bench\": \"throughput\", \"threads\": %d, "
+		       "\"tasks\": %d, \"sec\": %.6f, \"tasks_per_sec\": %.0f}\n",
+		       threads, total, sec, total / sec);
+		thread_pool_delete(pool);
+	}
+	for (int i = 0; i < batch; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+}
+
+/**
+ * One task at a time into a pool with idle threads: time from
+ * the push till the task starts, and from the task end till its
+ * joiner wakes up.
+ */
+static void
+bench_latency(int scale)
+{
+	int count = 20000 * scale;
+	uint64_t *start_lat = malloc(count * sizeof(uint64_t));
+	uint64_t *wake_lat = malloc(count * sizeof(uint64_t));
+	struct thread_pool *pool = pool_new(4);
+	struct thread_task *task;
+	uint64_t stamp;
+	void *result;
+	thread_task_new(&task, task_stamp_f, &stamp);
+	for (int i = 0; i < count; ++i) {
+		uint64_t push = now_ns();
+		thread_pool_push_task(pool, task);
+		thread_task_join(task, &result);
+		uint64_t wake = now_ns();
+		start_lat[i] = stamp - push;
+		wake_lat[i] = wake - stamp;
+	}
+	printf("{\"bench\": \"submit_to_start\", \"samples\": %d, ", count);
+	print_percentiles(start_lat, count);
+	printf("}\n");
+	/* The stamp is taken a bit before the task ends, it is an upper bound. */
+	printf("{\"bench\": \"join_wake\", \"samples\": %d, ", count);
+	print_percentiles(wake_lat, count);
+	printf("}\n");
+	thread_task_delete(task);
+	thread_pool_delete(pool);
+	free(start_lat);
+	free(wake_lat);
+}
+
+/** A group of empty tasks pushed at once and waited for together. */
+static void
+bench_fan_out(int scale)
+{
+	enum { width = 64 };
+	int rounds = 2000 * scale;
+	uint64_t *samples = malloc(rounds * sizeof(uint64_t));
+	struct thread_pool *pool = pool_new(4);
+	struct thread_task_group *group;
+	struct thread_task *tasks[width];
+	void *result;
+	thread_task_group_new(&group);
+	for (int i = 0; i < width; ++i)
+		thread_task_new(&tasks[i], task_empty_f, NULL);
+	for (int r = 0; r < rounds; ++r) {
+		uint64_t start = now_ns();
+		for (int i = 0; i < width; ++i)
+			thread_task_group_push(group, pool, tasks[i]);
+		thread_task_group_wait_all(group);
+		samples[r] = now_ns() - start;
+		for (int i = 0; i < width; ++i)
+			thread_task_join(tasks[i], &result);
+	}
+	printf("{\"bench\": \"fan_out_fan_in\", \"width\": %d, "
+	       "\"samples\": %d, ", width, rounds);
+	print_percentiles(samples, rounds);
+	printf("}\n");
+	for (int i = 0; i < width; ++i)
+		thread_task_delete(tasks[i]);
+	thread_task_group_delete(group);
+	thread_pool_delete(pool);
+	free(samples);
+}
+
+/** The baseline: a new thread per empty task. */
+static void
+bench_pthread_create(int scale)
+{
+	enum { batch = 16 };
+	int total = 20000 * scale;
+	pthread_t threads[batch];
+	uint64_t start = now_ns();
+	for (int done = 0; done < total; done += batch) {
+		for (int i = 0; i < batch; ++i)
+			pthread_create(&threads[i], NULL, task_empty_f, NULL);
+		for (int i = 0; i < batch; ++i)
+			pthread_join(threads[i], NULL);
+	}
+	double sec = (now_ns() - start) / 1e9;
+	printf("{\"bench\": \"pthread_create\", \"threads\": %d, "
+	       "\"tasks\": %d, \"sec\": %.6f, \"tasks_per_sec\": %.0f}\n",
+	       batch, total, sec, total / sec);
+}
+
+int
+main(int argc, char **argv)
+{
+	int scale = argc > 1 ? atoi(argv[1]) : 1;
+	if (scale <= 0) {
+		fprintf(stderr, "usage: %s [scale]\n", argv[0]);
+		return 1;
+	}
+	bench_throughput(scale);
+	bench_latency(scale);
+	bench_fan_out(scale);
+	bench_pthread_create(scale);
+	return 0;
+}
@@ -1,6 +1,10 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
 #include "unit.h"
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <unistd.h>
 
 static void
@@ -323,9 +327,1250 @@ test_detach(void)
 #endif
 }
 
+static void
+test_task_group(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task_group *g;
+	struct thread_task *t;
+	const int count = 100;
+	struct thread_task *tasks[count];
+	int arg = 0;
+	int flag = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	unit_check(thread_task_group_new(&g) == 0, "created new group");
+	unit_check(thread_task_group_wait_any(g, &t) == TPOOL_ERR_NO_TASKS,
+		   "wait any on an empty group");
+	/*
+	 * Wait all.
+	 */
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+		unit_fail_if(thread_task_group_push(g, p, tasks[i]) != 0);
+	}
+	unit_check(thread_task_group_push(g, p, tasks[0]) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't push a task twice");
+	unit_check(thread_task_delete(tasks[0]) == TPOOL_ERR_TASK_IN_POOL,
+		   "can't delete a grouped task");
+	unit_check(thread_task_group_wait_all(g) == 0, "waited all");
+	unit_check(arg == count, "all tasks are finished");
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(!thread_task_is_finished(tasks[i]));
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(result != &arg);
+	}
+	/*
+	 * Wait any returns tasks in completion order, a blocked one
+	 * goes last. It is pushed last too, because the pool might
+	 * have only one thread so far.
+	 */
+	unit_fail_if(thread_task_delete(tasks[0]) != 0);
+	unit_fail_if(thread_task_new(&tasks[0], task_wait_for_f, &flag) != 0);
+	for (int i = count - 1; i >= 0; --i)
+		unit_fail_if(thread_task_group_push(g, p, tasks[i]) != 0);
+	for (int i = 1; i < count; ++i) {
+		unit_fail_if(thread_task_group_wait_any(g, &t) != 0);
+		unit_fail_if(t == tasks[0]);
+		unit_fail_if(thread_task_join(t, &result) != 0);
+	}
+	unit_check(thread_task_group_delete(g) == TPOOL_ERR_HAS_TASKS,
+		   "can't delete a group with pending tasks");
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_check(thread_task_group_wait_any(g, &t) == 0 && t == tasks[0],
+		   "the blocked task is the last one");
+	unit_check(thread_task_group_wait_any(g, &t) == TPOOL_ERR_NO_TASKS,
+		   "no more tasks");
+	for (int i = 0; i < count; ++i) {
+		if (i == 0)
+			unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(thread_task_group_delete(g) == 0, "deleted group");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void *
+group_wait_all_f(void *arg)
+{
+	return (void *)(intptr_t)thread_task_group_wait_all(arg);
+}
+
+static void
+test_task_group_waiters(void)
+{
+	unit_test_start();
+
+	/* More than a byte of waiters, they used to overflow into tasks. */
+	enum { waiter_count = 300 };
+	struct thread_pool *p;
+	struct thread_task_group *g;
+	struct thread_task *t;
+	pthread_t waiters[waiter_count];
+	int flag = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	unit_fail_if(thread_task_group_new(&g) != 0);
+	unit_fail_if(thread_task_new(&t, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_task_group_push(g, p, t) != 0);
+	for (int i = 0; i < waiter_count; ++i) {
+		unit_fail_if(pthread_create(&waiters[i], NULL, group_wait_all_f,
+					    g) != 0);
+	}
+	usleep(50000);
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	bool is_ok = true;
+	for (int i = 0; i < waiter_count; ++i) {
+		unit_fail_if(pthread_join(waiters[i], &result) != 0);
+		is_ok = is_ok && result == NULL;
+	}
+	unit_check(is_ok, "all waiters are woken up");
+	unit_check(thread_task_group_wait_any(g, &t) == TPOOL_ERR_NO_TASKS,
+		   "the task is collected by a waiter");
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_check(thread_task_group_delete(g) == 0, "deleted group");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+struct stage_arg {
+	int *log;
+	int *pos;
+	int id;
+};
+
+static void *
+task_stage_f(void *arg)
+{
+	struct stage_arg *a = arg;
+	a->log[__atomic_fetch_add(a->pos, 1, __ATOMIC_RELAXED)] = a->id;
+	return arg;
+}
+
+static void
+test_task_then(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *sort1, *sort2, *merge, *write;
+	int log[5], pos = 0;
+	struct stage_arg args[4];
+	void *result;
+	for (int i = 0; i < 4; ++i) {
+		args[i].log = log;
+		args[i].pos = &pos;
+		args[i].id = i;
+	}
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	unit_fail_if(thread_task_new(&sort1, task_stage_f, &args[0]) != 0);
+	unit_fail_if(thread_task_new(&sort2, task_stage_f, &args[1]) != 0);
+	unit_fail_if(thread_task_new(&merge, task_stage_f, &args[2]) != 0);
+	unit_fail_if(thread_task_new(&write, task_stage_f, &args[3]) != 0);
+	unit_check(thread_task_then(merge, merge) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "a task can't depend on itself");
+	/*
+	 * sort1, sort2 -> merge -> write. Pushed in reverse order, so
+	 * only dependencies can make them run in the right one.
+	 */
+	unit_check(thread_task_then(sort1, merge) == 0, "first dependency");
+	unit_check(thread_task_then(sort2, merge) == 0, "second dependency");
+	unit_check(thread_task_then(merge, write) == 0, "continuation");
+	unit_fail_if(thread_pool_push_task(p, write) != 0);
+	unit_fail_if(thread_pool_push_task(p, merge) != 0);
+	usleep(1000);
+	unit_check(pos == 0 && !thread_task_is_running(write) &&
+		   !thread_task_is_finished(write), "waiting for dependencies");
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "not queued tasks are counted");
+	unit_check(thread_task_then(write, sort1) == TPOOL_ERR_TASK_IN_POOL,
+		   "can't add a dependency to a pushed task");
+	unit_fail_if(thread_pool_push_task(p, sort1) != 0);
+	unit_fail_if(thread_pool_push_task(p, sort2) != 0);
+	unit_check(thread_task_join(write, &result) == 0 && result == &args[3],
+		   "joined the last stage");
+	unit_check(pos == 4 && log[2] == 2 && log[3] == 3 &&
+		   log[0] + log[1] == 1, "stages are run in order");
+	unit_fail_if(thread_task_join(sort1, &result) != 0);
+	unit_fail_if(thread_task_join(sort2, &result) != 0);
+	unit_fail_if(thread_task_join(merge, &result) != 0);
+	/*
+	 * Edges are used once, a re-pushed task runs immediately.
+	 */
+	unit_fail_if(thread_pool_push_task(p, write) != 0);
+	unit_check(thread_task_join(write, &result) == 0 && pos == 5,
+		   "re-pushed without dependencies");
+	unit_fail_if(thread_task_delete(sort1) != 0);
+	unit_fail_if(thread_task_delete(sort2) != 0);
+	unit_fail_if(thread_task_delete(merge) != 0);
+	unit_fail_if(thread_task_delete(write) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *blocker;
+	const int count = 10;
+	struct thread_task *tasks[TPOOL_PRIO_COUNT][count];
+	struct stage_arg args[TPOOL_PRIO_COUNT];
+	int log[TPOOL_PRIO_COUNT * count], pos = 0;
+	int flag = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &flag) != 0);
+	unit_check(thread_task_set_priority(blocker, TPOOL_PRIO_COUNT) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "bad priority");
+	/*
+	 * Occupy the only thread and fill all the lanes, low first.
+	 */
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	for (int prio = TPOOL_PRIO_COUNT - 1; prio >= 0; --prio) {
+		args[prio].log = log;
+		args[prio].pos = &pos;
+		args[prio].id = prio;
+		for (int i = 0; i < count; ++i) {
+			struct thread_task **t = &tasks[prio][i];
+			unit_fail_if(thread_task_new(t, task_stage_f,
+						     &args[prio]) != 0);
+			unit_fail_if(thread_pool_push_task_prio(p, *t,
+								prio) != 0);
+		}
+	}
+	unit_check(thread_pool_push_task_prio(p, tasks[0][0], TPOOL_PRIO_LOW) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't change priority in a pool");
+	unit_check(thread_pool_queue_depth(p, TPOOL_PRIO_HIGH) == count &&
+		   thread_pool_queue_depth(p, TPOOL_PRIO_NORMAL) == count &&
+		   thread_pool_queue_depth(p, TPOOL_PRIO_LOW) == count,
+		   "queue depth per lane");
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	for (int prio = 0; prio < TPOOL_PRIO_COUNT; ++prio) {
+		for (int i = 0; i < count; ++i) {
+			unit_fail_if(thread_task_join(tasks[prio][i],
+						      &result) != 0);
+			unit_fail_if(thread_task_delete(tasks[prio][i]) != 0);
+		}
+	}
+	bool is_high_first = true;
+	for (int i = 0; i < count; ++i)
+		is_high_first = is_high_first && log[i] == TPOOL_PRIO_HIGH;
+	unit_check(is_high_first, "high priority tasks go first");
+	int last_normal = 0, first_low = -1;
+	for (int i = 0; i < TPOOL_PRIO_COUNT * count; ++i) {
+		if (log[i] == TPOOL_PRIO_NORMAL)
+			last_normal = i;
+		else if (log[i] == TPOOL_PRIO_LOW && first_low < 0)
+			first_low = i;
+	}
+	unit_check(first_low < last_normal, "low priority is not starved");
+	unit_check(thread_pool_queue_depth(p, TPOOL_PRIO_LOW) == 0,
+		   "queue is empty");
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_idle_threads(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_opts opts;
+	struct thread_task *tasks[4];
+	int flag = 0;
+	void *result;
+	thread_pool_opts_create(&opts);
+	opts.max_thread_count = 4;
+	opts.idle_timeout = 0.05;
+	unit_check(thread_pool_new_opts(&opts, &p) == 0, "created with opts");
+	/*
+	 * Blocked tasks make the queue deeper than the idle thread
+	 * count, so each of them gets a thread.
+	 */
+	for (int i = 0; i < 4; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &flag) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	unit_check(thread_pool_thread_count(p) == 4, "a thread per task");
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	/*
+	 * Idle threads go away and come back on demand.
+	 */
+	for (int i = 0; i < 100 && thread_pool_thread_count(p) != 0; ++i)
+		usleep(10000);
+	unit_check(thread_pool_thread_count(p) == 0, "idle threads exited");
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	unit_fail_if(thread_task_join(tasks[0], &result) != 0);
+	unit_check(thread_pool_thread_count(p) == 1, "a thread is back");
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	opts.spin_count = -1;
+	unit_check(thread_pool_new_opts(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative spin count");
+
+	unit_test_finish();
+}
+
+static void *
+task_affinity_f(void *arg)
+{
+	cpu_set_t set;
+	pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+	*(int *)arg = CPU_COUNT(&set) == 1 && CPU_ISSET(0, &set);
+	return arg;
+}
+
+/** Save the CPU set the thread is pinned to. */
+static void *
+task_cpu_mask_f(void *arg)
+{
+	pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), arg);
+	return arg;
+}
+
+static void
+test_placement(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_opts opts;
+	struct thread_task *t;
+	int arg = 0;
+	void *result;
+	int cpus[] = {0};
+	thread_pool_opts_create(&opts);
+	opts.placement = TPOOL_PLACE_CPUSET;
+	unit_check(thread_pool_new_opts(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "CPU set placement needs CPUs");
+	opts.cpus = cpus;
+	opts.cpu_count = 1;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	unit_check(thread_pool_node_count(p) == 0, "no nodes without NUMA");
+	unit_fail_if(thread_task_new(&t, task_affinity_f, &arg) != 0);
+	unit_check(thread_pool_push_task_node(p, t, 0) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no node queues");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(arg == 1, "thread is pinned to the CPU set");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	opts.placement = TPOOL_PLACE_CORES;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_join(t, &result) == 0, "core placement works");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	opts.placement = TPOOL_PLACE_NUMA;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	int node_count = thread_pool_node_count(p);
+	unit_check(node_count >= 1, "at least one node");
+	cpu_set_t *masks = calloc(node_count, sizeof(*masks));
+	for (int node = 0; node < node_count; ++node) {
+		struct thread_task *nt;
+		unit_fail_if(thread_task_new(&nt, task_cpu_mask_f,
+					     &masks[node]) != 0);
+		unit_fail_if(thread_pool_push_task_node(p, nt, node) != 0);
+		unit_fail_if(thread_task_join(nt, &result) != 0);
+		unit_fail_if(thread_task_delete(nt) != 0);
+	}
+	/*
+	 * A task can be stolen by a thread of another node, but any
+	 * thread is pinned to a whole node. So two masks are either
+	 * the same node or do not intersect.
+	 */
+	bool is_node_masks = true;
+	for (int i = 0; i < node_count; ++i) {
+		is_node_masks = is_node_masks && CPU_COUNT(&masks[i]) > 0;
+		for (int j = 0; j < i; ++j) {
+			cpu_set_t common;
+			CPU_AND(&common, &masks[i], &masks[j]);
+			is_node_masks = is_node_masks &&
+					(CPU_EQUAL(&masks[i], &masks[j]) ||
+					 CPU_COUNT(&common) == 0);
+		}
+	}
+	free(masks);
+	unit_check(is_node_masks, "node tasks run on threads pinned to a node");
+	unit_check(thread_pool_push_task_node(p, t, node_count) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no such node");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_join(t, &result) == 0, "shared queue works");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+range_fill_f(void *ctx, size_t begin, size_t end)
+{
+	int *arr = ctx;
+	for (size_t i = begin; i < end; ++i)
+		arr[i] += (int)i;
+}
+
+static void
+range_sum_f(void *ctx, size_t begin, size_t end, void *acc)
+{
+	(void)ctx;
+	for (size_t i = begin; i < end; ++i)
+		*(int64_t *)acc += i;
+}
+
+static void
+sum_combine_f(void *ctx, void *acc, const void *other)
+{
+	(void)ctx;
+	*(int64_t *)acc += *(const int64_t *)other;
+}
+
+static void
+test_parallel(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+
+	enum { count = 100000 };
+	int *arr = calloc(count, sizeof(*arr));
+	unit_fail_if(thread_pool_parallel_for(p, 0, count, 0, range_fill_f,
+					      arr) != 0);
+	unit_fail_if(thread_pool_parallel_for(p, 10, count, 1000, range_fill_f,
+					      arr) != 0);
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i)
+		is_ok = is_ok && arr[i] == (i < 10 ? i : 2 * i);
+	unit_check(is_ok, "each index is visited exactly once");
+	free(arr);
+
+	int64_t sum = 0;
+	unit_fail_if(thread_pool_parallel_reduce(p, 0, count, 0, range_sum_f,
+						 sum_combine_f, NULL, &sum,
+						 sizeof(sum)) != 0);
+	unit_check(sum == (int64_t)count * (count - 1) / 2, "auto grain sum");
+	sum = 0;
+	unit_fail_if(thread_pool_parallel_reduce(p, 0, count, 7, range_sum_f,
+						 sum_combine_f, NULL, &sum,
+						 sizeof(sum)) != 0);
+	unit_check(sum == (int64_t)count * (count - 1) / 2, "small grain sum");
+	sum = 0;
+	unit_fail_if(thread_pool_parallel_reduce(p, 5, 6, 0, range_sum_f,
+						 sum_combine_f, NULL, &sum,
+						 sizeof(sum)) != 0);
+	unit_check(sum == 5, "single element");
+	unit_check(thread_pool_parallel_for(p, 5, 4, 0, range_fill_f, NULL) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "reversed range");
+	unit_check(thread_pool_delete(p) == 0, "no helpers are left");
+
+	unit_test_finish();
+}
+
+static void *
+flag_set_later_f(void *arg)
+{
+	usleep(10000);
+	__atomic_store_n((int *)arg, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+struct producer_arg {
+	struct thread_pool *pool;
+	int *counter;
+	int count;
+};
+
+static void *
+producer_f(void *arg)
+{
+	struct producer_arg *a = arg;
+	for (int i = 0; i < a->count; ++i) {
+		struct thread_task *t;
+		unit_fail_if(thread_task_new(&t, task_incr_f, a->counter) != 0);
+		unit_fail_if(thread_pool_push_task_wait(a->pool, t) != 0);
+		unit_fail_if(thread_task_detach(t) != 0);
+	}
+	return NULL;
+}
+
+static void
+test_push_wait(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_opts opts;
+	thread_pool_opts_create(&opts);
+	opts.max_thread_count = TPOOL_OPTS_MAX_THREADS + 1;
+	unit_check(thread_pool_new_opts(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "too many threads in opts");
+	opts.max_thread_count = 64;
+	opts.max_task_count = 0;
+	unit_check(thread_pool_new_opts(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "zero task limit");
+	opts.max_task_count = 2;
+	unit_check(thread_pool_new_opts(&opts, &p) == 0,
+		   "more threads than thread_pool_new() allows");
+
+	int flag = 0;
+	void *result;
+	struct thread_task *t1, *t2, *t3;
+	unit_fail_if(thread_task_new(&t1, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_task_new(&t2, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_task_new(&t3, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_pool_push_task(p, t1) != 0);
+	unit_fail_if(thread_pool_push_task(p, t2) != 0);
+	unit_check(thread_pool_push_task(p, t3) == TPOOL_ERR_TOO_MANY_TASKS,
+		   "the task limit is set by opts");
+	unit_check(thread_pool_push_task_timed(p, t3, 0) == TPOOL_ERR_TIMEOUT,
+		   "timed push on 0");
+	unit_check(thread_pool_push_task_timed(p, t3, 0.01) ==
+		   TPOOL_ERR_TIMEOUT, "timed push on 10 ms");
+	pthread_t th;
+	pthread_create(&th, NULL, flag_set_later_f, &flag);
+	unit_check(thread_pool_push_task_wait(p, t3) == 0, "waited for a slot");
+	unit_check(__atomic_load_n(&flag, __ATOMIC_RELAXED) == 1,
+		   "only after a task finished");
+	pthread_join(th, NULL);
+	unit_fail_if(thread_task_join(t1, &result) != 0);
+	unit_fail_if(thread_task_join(t2, &result) != 0);
+	unit_fail_if(thread_task_join(t3, &result) != 0);
+	unit_fail_if(thread_task_delete(t1) != 0);
+	unit_fail_if(thread_task_delete(t2) != 0);
+	unit_fail_if(thread_task_delete(t3) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * Many producers throttled by a small limit.
+	 */
+	opts.max_thread_count = 4;
+	opts.max_task_count = 8;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	enum { producer_count = 4, per_producer = 2000 };
+	int counter = 0;
+	struct producer_arg arg = {p, &counter, per_producer};
+	pthread_t producers[producer_count];
+	for (int i = 0; i < producer_count; ++i)
+		pthread_create(&producers[i], NULL, producer_f, &arg);
+	for (int i = 0; i < producer_count; ++i)
+		pthread_join(producers[i], NULL);
+	while (__atomic_load_n(&counter, __ATOMIC_RELAXED) !=
+	       producer_count * per_producer)
+		usleep(100);
+	unit_check(true, "all throttled tasks are done");
+	while (thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS)
+		usleep(100);
+
+	unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_opts opts;
+	thread_pool_opts_create(&opts);
+	opts.max_thread_count = 2;
+	opts.idle_timeout = 0;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+
+	struct thread_pool_stats stats;
+	thread_pool_stats(p, &stats);
+	unit_check(stats.thread_count == 0 && stats.completed == 0 &&
+		   stats.spawn_count == 0, "empty pool");
+	unit_check(thread_pool_hist_percentile(stats.exec_hist, 50) == 0,
+		   "empty histogram");
+
+	enum { count = 100 };
+	int arg = 0;
+	void *result;
+	struct thread_task *tasks[count];
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	thread_pool_stats(p, &stats);
+	unit_check(stats.completed == count, "completed tasks");
+	unit_check(stats.task_count == 0 && stats.queue_depth == 0,
+		   "nothing is left");
+	unit_check(stats.spawn_count >= 1 &&
+		   stats.spawn_count == (uint64_t)stats.thread_count,
+		   "spawned threads");
+	uint64_t waits = 0, execs = 0;
+	for (int i = 0; i < TPOOL_HIST_BUCKETS; ++i) {
+		waits += stats.queue_wait_hist[i];
+		execs += stats.exec_hist[i];
+	}
+	unit_check(waits == count && execs == count, "each task is measured");
+	unit_check(stats.busy_time > 0, "busy time");
+
+	struct thread_pool_worker_stats ws[TPOOL_MAX_THREADS];
+	int worker_count = thread_pool_worker_stats(p, ws, TPOOL_MAX_THREADS);
+	uint64_t completed = 0;
+	for (int i = 0; i < worker_count; ++i)
+		completed += ws[i].completed;
+	unit_check(worker_count == stats.thread_count && completed == count,
+		   "per thread stats add up");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	uint64_t hist[TPOOL_HIST_BUCKETS] = {0};
+	hist[2] = 1;
+	hist[10] = 1;
+	unit_check(thread_pool_hist_percentile(hist, 0) == 2, "exact bucket");
+	unit_check(thread_pool_hist_percentile(hist, 100) == 13,
+		   "upper bound of a log bucket");
+
+	unit_test_finish();
+}
+
+static void
+test_cancel(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	int flag = 0, arg = 0;
+	void *result;
+	struct thread_task *blocker, *t1, *t2, *t3;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_task_new(&t1, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&t2, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&t3, task_incr_f, &arg) != 0);
+	unit_check(thread_task_cancel(t1) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "can't cancel a not pushed task");
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	unit_check(thread_task_cancel(blocker) == TPOOL_ERR_TASK_STARTED,
+		   "can't cancel a running task");
+	/*
+	 * A queued task is removed, its successor still runs.
+	 */
+	unit_fail_if(thread_task_then(t1, t2) != 0);
+	unit_fail_if(thread_pool_push_task(p, t2) != 0);
+	unit_fail_if(thread_pool_push_task(p, t1) != 0);
+	unit_check(thread_task_cancel(t1) == 0, "cancelled a queued task");
+	unit_check(thread_task_cancel(t1) == 0, "cancel is idempotent");
+	unit_check(thread_task_is_finished(t1), "cancelled task is finished");
+	unit_check(thread_task_join(t1, &result) == TPOOL_ERR_TASK_CANCELLED &&
+		   result == NULL, "join reports cancel");
+	/*
+	 * A stale task is dropped by the worker.
+	 */
+	unit_check(thread_task_set_deadline(t3, -1) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative deadline");
+	unit_fail_if(thread_task_set_deadline(t3, 0.001) != 0);
+	unit_fail_if(thread_pool_push_task(p, t3) != 0);
+	unit_check(thread_task_set_deadline(t3, 1) == TPOOL_ERR_TASK_IN_POOL,
+		   "can't set deadline of a pushed task");
+	usleep(10000);
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_check(thread_task_join(t2, &result) == 0 && arg == 1,
+		   "successor of a cancelled task runs");
+	unit_check(thread_task_join(t3, &result) == TPOOL_ERR_TASK_CANCELLED,
+		   "expired task is dropped");
+	unit_check(arg == 1, "dropped tasks did not run");
+	struct thread_pool_stats stats;
+	thread_pool_stats(p, &stats);
+	unit_check(stats.cancel_count == 1 && stats.expire_count == 1,
+		   "drops are counted");
+	/*
+	 * The deadline is re-armed on each push.
+	 */
+	unit_fail_if(thread_task_set_deadline(t3, 10) != 0);
+	unit_fail_if(thread_pool_push_task(p, t3) != 0);
+	unit_check(thread_task_join(t3, &result) == 0 && arg == 2,
+		   "fresh task runs");
+
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_task_delete(t1) != 0);
+	unit_fail_if(thread_task_delete(t2) != 0);
+	unit_fail_if(thread_task_delete(t3) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_completion_fd(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	unit_check(thread_pool_completion_fd(p) == -1, "no queue by default");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	struct thread_pool_opts opts;
+	thread_pool_opts_create(&opts);
+	opts.max_thread_count = 2;
+	opts.completion_queue = true;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	struct pollfd pfd = {.fd = thread_pool_completion_fd(p),
+			     .events = POLLIN};
+	unit_check(pfd.fd >= 0, "got eventfd");
+	unit_check(poll(&pfd, 1, 0) == 0, "not readable while idle");
+
+	enum { count = 50 };
+	int arg = 0;
+	void *result;
+	struct thread_task *tasks[count];
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	/* An event loop with a batch smaller than the task count. */
+	int drained = 0;
+	bool is_ok = true;
+	while (drained < count) {
+		unit_fail_if(poll(&pfd, 1, 1000) != 1);
+		struct thread_task *batch[16];
+		int n = thread_pool_drain_completions(p, batch, 16);
+		for (int i = 0; i < n; ++i)
+			is_ok = is_ok && thread_task_join(batch[i], &result) == 0;
+		drained += n;
+	}
+	unit_check(is_ok && drained == count, "all tasks are drained");
+	unit_check(poll(&pfd, 1, 0) == 0, "not readable when drained");
+	/*
+	 * Finished tasks are held until drained.
+	 */
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	unit_fail_if(thread_task_join(tasks[0], &result) != 0);
+	unit_check(thread_task_delete(tasks[0]) == TPOOL_ERR_TASK_IN_POOL,
+		   "can't delete before drain");
+	unit_check(thread_pool_push_task(p, tasks[0]) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't push before drain");
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "can't delete pool with undrained tasks");
+	struct thread_task *t;
+	unit_check(thread_pool_drain_completions(p, &t, 1) == 1 &&
+		   t == tasks[0], "drained the re-pushed task");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_completion(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_completion *c;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	unit_fail_if(thread_completion_new(&c) != 0);
+	int flag = 0, arg = 0;
+	void *result;
+	struct thread_task *slow, *fast1, *fast2, *t;
+	unit_fail_if(thread_task_new(&slow, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_task_new(&fast1, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&fast2, task_incr_f, &arg) != 0);
+	unit_check(thread_completion_try_pop(c, &t) == TPOOL_ERR_NO_TASKS,
+		   "empty queue");
+	unit_fail_if(thread_task_set_completion(slow, c) != 0);
+	unit_fail_if(thread_task_set_completion(fast1, c) != 0);
+	unit_fail_if(thread_task_set_completion(fast2, c) != 0);
+	unit_fail_if(thread_pool_push_task(p, slow) != 0);
+	unit_fail_if(thread_pool_push_task(p, fast1) != 0);
+	unit_fail_if(thread_pool_push_task(p, fast2) != 0);
+	unit_check(thread_task_set_completion(slow, NULL) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't rebind a pushed task");
+	/*
+	 * Tasks come in completion order, not in push order.
+	 */
+	struct thread_task *first, *second;
+	unit_fail_if(thread_completion_pop(c, &first) != 0);
+	unit_fail_if(thread_completion_pop(c, &second) != 0);
+	unit_check(first != slow && second != slow && first != second,
+		   "fast tasks first");
+	unit_fail_if(thread_task_join(first, &result) != 0);
+	unit_fail_if(thread_task_join(second, &result) != 0);
+	unit_check(thread_completion_try_pop(c, &t) == TPOOL_ERR_TIMEOUT,
+		   "try pop of a not finished task");
+	unit_check(thread_completion_timed_pop(c, 0.01, &t) ==
+		   TPOOL_ERR_TIMEOUT, "timed pop of a not finished task");
+	unit_check(thread_completion_delete(c) == TPOOL_ERR_HAS_TASKS,
+		   "can't delete with pending tasks");
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_check(thread_completion_timed_pop(c, 10, &t) == 0 && t == slow,
+		   "slow task last");
+	unit_fail_if(thread_task_join(slow, &result) != 0);
+	unit_check(thread_completion_pop(c, &t) == TPOOL_ERR_NO_TASKS,
+		   "nothing to wait for");
+	/*
+	 * Batch pop.
+	 */
+	enum { count = 20 };
+	struct thread_task *tasks[count];
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+		unit_fail_if(thread_task_set_completion(tasks[i], c) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	int popped = 0;
+	while (popped < count) {
+		struct thread_task *batch[8];
+		int n = thread_completion_pop_batch(c, batch, 8);
+		unit_fail_if(n <= 0);
+		for (int i = 0; i < n; ++i)
+			unit_fail_if(thread_task_join(batch[i], &result) != 0);
+		popped += n;
+	}
+	unit_check(popped == count && arg == count + 2, "batch pop");
+	unit_check(thread_completion_pop_batch(c, tasks, count) == 0,
+		   "empty batch");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_task_delete(slow) != 0);
+	unit_fail_if(thread_task_delete(fast1) != 0);
+	unit_fail_if(thread_task_delete(fast2) != 0);
+	unit_check(thread_completion_delete(c) == 0, "deleted queue");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+struct fiber_arg {
+	struct thread_task **self;
+	int *started;
+	int *done;
+};
+
+static void *
+task_suspend_f(void *arg)
+{
+	struct fiber_arg *a = arg;
+	*a->self = thread_task_self();
+	__atomic_add_fetch(a->started, 1, __ATOMIC_RELEASE);
+	thread_task_suspend();
+	__atomic_add_fetch(a->done, 1, __ATOMIC_RELAXED);
+	return arg;
+}
+
+static void *
+task_yield_until_f(void *arg)
+{
+	struct fiber_arg *a = arg;
+	__atomic_add_fetch(a->started, 1, __ATOMIC_RELAXED);
+	/* Needs the other fiber to start on the same thread. */
+	while (__atomic_load_n(a->started, __ATOMIC_RELAXED) < 2)
+		thread_task_yield();
+	__atomic_add_fetch(a->done, 1, __ATOMIC_RELAXED);
+	return arg;
+}
+
+static void
+test_fiber(void)
+{
+	unit_test_start();
+#ifdef __SANITIZE_THREAD__
+	/* TSan can't follow libcoro stack switches done by longjmp. */
+	unit_check(true, "skipped under TSan");
+#else
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	unit_check(thread_task_self() == NULL, "no task outside of pool");
+	unit_check(thread_task_suspend() == TPOOL_ERR_INVALID_ARGUMENT,
+		   "can't suspend outside of pool");
+	/*
+	 * More suspended fibers than threads.
+	 */
+	enum { count = 5 };
+	int started = 0, done = 0;
+	void *result;
+	struct thread_task *tasks[count], *selves[count];
+	struct fiber_arg args[count];
+	for (int i = 0; i < count; ++i) {
+		args[i] = (struct fiber_arg){&selves[i], &started, &done};
+		unit_fail_if(thread_task_new(&tasks[i], task_suspend_f,
+					     &args[i]) != 0);
+		unit_fail_if(thread_task_set_fiber(tasks[i], true) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	unit_check(thread_task_set_fiber(tasks[0], false) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't change a pushed task");
+	while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) != count)
+		usleep(100);
+	unit_check(done == 0, "all fibers are suspended on one thread");
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i) {
+		is_ok = is_ok && selves[i] == tasks[i];
+		unit_fail_if(thread_task_resume(selves[i]) != 0);
+	}
+	unit_check(is_ok, "task self");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_check(done == count, "resumed fibers finished");
+	/*
+	 * Yield lets another fiber of the same thread run.
+	 */
+	started = 0;
+	done = 0;
+	for (int i = 0; i < 2; ++i) {
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+		unit_fail_if(thread_task_new(&tasks[i], task_yield_until_f,
+					     &args[i]) != 0);
+		unit_fail_if(thread_task_set_fiber(tasks[i], true) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	unit_fail_if(thread_task_join(tasks[0], &result) != 0);
+	unit_fail_if(thread_task_join(tasks[1], &result) != 0);
+	unit_check(done == 2, "yielding fibers finished");
+	/*
+	 * Resume before suspend, a plain task.
+	 */
+	started = 0;
+	done = 0;
+	unit_fail_if(thread_task_delete(tasks[0]) != 0);
+	unit_fail_if(thread_task_new(&tasks[0], task_suspend_f, &args[0]) != 0);
+	unit_fail_if(thread_task_resume(tasks[0]) != 0);
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) != 1)
+		usleep(100);
+	unit_fail_if(thread_task_resume(tasks[0]) != 0);
+	unit_fail_if(thread_task_join(tasks[0], &result) != 0);
+	unit_check(done == 1, "plain task is resumed");
+
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+#endif
+	unit_test_finish();
+}
+
+struct strand_arg {
+	int *log;
+	int *log_size;
+	int *in_flight;
+	bool *overlap;
+	int value;
+};
+
+static void *
+task_strand_f(void *arg)
+{
+	struct strand_arg *a = arg;
+	if (__atomic_add_fetch(a->in_flight, 1, __ATOMIC_RELAXED) != 1)
+		*a->overlap = true;
+	sched_yield();
+	a->log[(*a->log_size)++] = a->value;
+	__atomic_sub_fetch(a->in_flight, 1, __ATOMIC_RELAXED);
+	return arg;
+}
+
+static void
+test_strand(void)
+{
+	unit_test_start();
+
+	enum { strand_count = 3, count = 100 };
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	struct thread_strand *strands[strand_count];
+	int logs[strand_count][count], log_sizes[strand_count] = {0};
+	int in_flight[strand_count] = {0};
+	bool overlap[strand_count] = {false};
+	struct strand_arg args[strand_count][count];
+	struct thread_task *tasks[strand_count][count];
+	void *result;
+	for (int s = 0; s < strand_count; ++s)
+		unit_fail_if(thread_strand_new(&strands[s], p) != 0);
+	/*
+	 * Interleaved pushes into several strands.
+	 */
+	for (int i = 0; i < count; ++i) {
+		for (int s = 0; s < strand_count; ++s) {
+			args[s][i] = (struct strand_arg){logs[s], &log_sizes[s],
+				&in_flight[s], &overlap[s], i};
+			unit_fail_if(thread_task_new(&tasks[s][i], task_strand_f,
+						     &args[s][i]) != 0);
+			unit_fail_if(thread_strand_push(strands[s],
+							tasks[s][i]) != 0);
+		}
+	}
+	for (int s = 0; s < strand_count; ++s) {
+		for (int i = 0; i < count; ++i)
+			unit_fail_if(thread_task_join(tasks[s][i], &result) != 0);
+	}
+	bool is_ordered = true, is_serial = true;
+	for (int s = 0; s < strand_count; ++s) {
+		is_serial = is_serial && !overlap[s];
+		is_ordered = is_ordered && log_sizes[s] == count;
+		for (int i = 0; i < log_sizes[s]; ++i)
+			is_ordered = is_ordered && logs[s][i] == i;
+	}
+	unit_check(is_serial, "tasks of a strand do not overlap");
+	unit_check(is_ordered, "tasks of a strand run in push order");
+	/*
+	 * Delete with a not finished task.
+	 */
+	int flag = 0;
+	struct thread_task *blocker;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_strand_push(strands[0], blocker) != 0);
+	unit_check(thread_strand_delete(strands[0]) == TPOOL_ERR_HAS_TASKS,
+		   "can't delete a busy strand");
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_task_set_fiber(blocker, true) != 0);
+	unit_check(thread_strand_push(strands[0], blocker) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "can't push a fiber");
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	bool is_deleted = true;
+	for (int s = 0; s < strand_count; ++s)
+		is_deleted = is_deleted && thread_strand_delete(strands[s]) == 0;
+	unit_check(is_deleted, "strands are deleted once their tasks are joined");
+
+	for (int s = 0; s < strand_count; ++s) {
+		for (int i = 0; i < count; ++i)
+			unit_fail_if(thread_task_delete(tasks[s][i]) != 0);
+	}
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void *
+task_thread_f(void *arg)
+{
+	*(pthread_t *)arg = pthread_self();
+	return arg;
+}
+
+static void
+test_caller_runs(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_opts opts;
+	struct thread_pool_stats stats;
+	struct thread_task *blocker, *t;
+	pthread_t runner;
+	int flag = 0;
+	void *result;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_task_new(&t, task_thread_f, &runner) != 0);
+	/*
+	 * Cheap tasks are run by the pusher.
+	 */
+	thread_pool_opts_create(&opts);
+	opts.max_thread_count = 2;
+	opts.inline_cost = 1e-3;
+	unit_check(thread_task_set_cost(t, -1) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "negative cost");
+	unit_fail_if(thread_task_set_cost(t, 1e-6) != 0);
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_is_finished(t) &&
+		   pthread_equal(runner, pthread_self()), "cheap task is inline");
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_fail_if(thread_task_set_cost(t, 1) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(!pthread_equal(runner, pthread_self()),
+		   "costly task is queued");
+	thread_pool_stats(p, &stats);
+	unit_check(stats.caller_run_count == 1, "inline run is counted");
+	unit_fail_if(thread_pool_delete(p) != 0);
+	unit_fail_if(thread_task_set_cost(t, 0) != 0);
+	/*
+	 * A full pool makes the pusher run the task.
+	 */
+	opts.inline_cost = 0;
+	opts.max_task_count = 1;
+	opts.caller_runs = true;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_is_finished(t) &&
+		   pthread_equal(runner, pthread_self()),
+		   "caller runs on a full pool");
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * A joiner runs queued tasks while the thread is busy.
+	 */
+	flag = 0;
+	opts.max_thread_count = 1;
+	opts.max_task_count = TPOOL_MAX_TASKS;
+	opts.caller_runs = false;
+	opts.join_helps = true;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(pthread_equal(runner, pthread_self()),
+		   "joiner runs the queued task");
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_alloc_budget(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_opts opts;
+	struct thread_task *t;
+	int arg = 0;
+	void *result;
+	thread_pool_opts_create(&opts);
+	opts.max_thread_count = 4;
+	/* A thread exit and a new start would allocate. */
+	opts.idle_timeout = 0;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	/* Warmup: threads are started, lazy state is made. */
+	for (int i = 0; i < 100; ++i) {
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t, &result) != 0);
+	}
+	unit_check_alloc_count(0, "push and join do not allocate", {
+		for (int i = 0; i < 1000; ++i) {
+			unit_fail_if(thread_pool_push_task(p, t) != 0);
+			unit_fail_if(thread_task_join(t, &result) != 0);
+		}
+	});
+	unit_check(arg == 1100, "all tasks are done");
+	unit_check_alloc_budget(1, sizeof(void *) * 1024, "a bounded budget", {
+		free(malloc(16));
+	});
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_alloc_count(void)
+{
+	/*
+	 * Counted before any output. With HHSAMPLE=1 this is the first
+	 * sampled allocation, and the unwinder allocates and frees on
+	 * its first use, which must not be counted.
+	 */
+	bool is_tracked = unit_alloc_is_tracked();
+	uint64_t count = is_tracked ? heaph_get_alloc_count() : 0;
+	/* Volatile, or the pair is optimized out. */
+	void *volatile ptr = malloc(10);
+	uint64_t count_alloc = is_tracked ? heaph_get_alloc_count() : 0;
+	free(ptr);
+	uint64_t count_free = is_tracked ? heaph_get_alloc_count() : 0;
+
+	unit_test_start();
+
+	if (is_tracked) {
+		unit_check(count_alloc == count + 1,
+			   "an allocation is counted once");
+		unit_check(count_free == count, "its free is counted once");
+	} else {
+		printf("ok - allocation count # skip, no heap_help\n");
+	}
+
+	unit_test_finish();
+}
+
+static void
+test_sample_weight(void)
+{
+	unit_test_start();
+
+	int64_t before = heaph_get_sample_live_bytes != NULL ?
+			 heaph_get_sample_live_bytes() : -1;
+	if (before < 0) {
+		printf("ok - sample weight # skip, no HHSAMPLE\n");
+		unit_test_finish();
+		return;
+	}
+	/*
+	 * The block is bigger than any sane interval, so it is sampled
+	 * for sure. Not touched, it takes no memory.
+	 */
+	int64_t size = 256 << 20;
+	void *volatile ptr = malloc(size);
+	unit_fail_if(ptr == NULL);
+	int64_t grown = heaph_get_sample_live_bytes() - before;
+	unit_check(grown > size - size / 8 && grown < size + size / 8,
+		   "a big block is counted as about its size");
+	free(ptr);
+	int64_t left = heaph_get_sample_live_bytes() - before;
+	unit_check(left < size / 8, "its free takes the bytes back");
+
+	unit_test_finish();
+}
+
+static void
+test_bench(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	int arg = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	double ns = unit_bench("push_join", {
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t, &result) != 0);
+	});
+	unit_check(ns > 0, "push and join are measured");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
+	/* Before any output, see the test. */
+	test_alloc_count();
 	unit_test_start();
 
 	test_new();
@@ -334,6 +1579,24 @@ main(void)
 	test_thread_pool_max_tasks();
 	test_timed_join();
 	test_detach();
+	test_task_group();
+	test_task_group_waiters();
+	test_task_then();
+	test_priority();
+	test_idle_threads();
+	test_placement();
+	test_parallel();
+	test_push_wait();
+	test_stats();
+	test_cancel();
+	test_completion_fd();
+	test_completion();
+	test_fiber();
+	test_strand();
+	test_caller_runs();
+	test_alloc_budget();
+	test_sample_weight();
+	test_bench();
 
 	unit_test_finish();
 	return 0;
@@ -1,11 +1,24 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
+#include "libcoro.h"
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
+#include <limits.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <string.h>
+#include <dirent.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 
 typedef enum {
 	TINIT,
@@ -14,227 +27,2501 @@ typedef enum {
 	TFINISHED,
 } ThreadStatus_t;
 
+/**
+ * Task state word layout. The low bits hold ThreadStatus_t, the
+ * rest are flags. Status only moves forward by +1 steps while the
+ * task is in a pool, so the flags survive atomic_fetch_add().
+ */
+enum {
+	TASK_STATUS_MASK = 0x7,
+	/** Somebody sleeps on the state word in thread_task_join(). */
+	TASK_HAS_WAITER = 0x8,
+	/** The task deletes itself once it is finished. */
+	TASK_DETACHED = 0x10,
+	/** The task is dropped instead of being run. */
+	TASK_CANCELLED = 0x20,
+};
+
+/**
+ * Suspend handshake word of a task. Resume can come before the
+ * task suspends, then it is remembered and the suspend returns at
+ * once.
+ */
+enum {
+	WAKE_NONE,
+	/** Resume came while the task was running. */
+	WAKE_PENDING,
+	/** The task sleeps until a resume. Also a futex value. */
+	WAKE_SUSPENDED,
+};
+
+/** Why a fiber switched back to its thread. */
+enum {
+	FIBER_YIELD,
+	FIBER_SUSPEND,
+};
+
+/** How many times join polls the state before going to sleep. */
+#define TASK_JOIN_SPIN 128
+
+/**
+ * How many times a non-empty lane can be passed over in favor of
+ * higher ones before it is served out of turn.
+ */
+#define TPOOL_PRIO_AGING 16
+
 struct thread_task {
 	thread_task_f function;
 	void *arg;
 
-	void *result;
-	struct thread_task *next;
-	struct thread_task *prev;
-	ThreadStatus_t status;
-	pthread_mutex_t resultMutex;
-	pthread_cond_t resultCond;
-	bool isDetached;
-};
+	void *result;
+	struct thread_task *next;
+	struct thread_task *prev;
+	/** Status and flags, also used as a futex word. */
+	atomic_uint state;
+	/** Group the task belongs to until a waiter takes it back. */
+	struct thread_task_group *group;
+	/** Link in the group's finished list. */
+	struct thread_task *groupNext;
+	/** Pool the task was pushed to, used to queue it when ready. */
+	struct thread_pool *pool;
+	/**
+	 * Not finished dependencies plus one for the push itself. The
+	 * task is queued by whoever drops it to zero.
+	 */
+	atomic_int depCount;
+	/** Tasks which depend on this one. */
+	struct thread_task **successors;
+	int successorCount;
+	int successorCapacity;
+	/** Lane of the pool queue, one of TPOOL_PRIO_*. */
+	int priority;
+	/** Pool queue the task goes to: 0 is shared, others are nodes. */
+	int queueIndex;
+	/** The task is in a queue lane. Protected by the pool mutex. */
+	bool isQueued;
+	/** When the task became runnable, in nanoseconds. */
+	uint64_t queueTime;
+	/** Seconds from push till the task is stale, 0 for never. */
+	double timeout;
+	/** Absolute time of the timeout, set at push. */
+	uint64_t deadline;
+	/** Completion queue chosen by the user for next pushes. */
+	struct thread_completion *completionTarget;
+	/** Completion queue the task is held by until it is popped. */
+	struct thread_completion *completion;
+	/** Link in the completion queue. */
+	struct thread_task *completionNext;
+	/** Internal task of the pool, never reported to users. */
+	bool isHelper;
+	/**
+	 * Internal queue entry which is not a task: a thread only
+	 * calls the function, and the entry is not touched after that.
+	 */
+	bool isRaw;
+	/** Run on an own coroutine stack, see thread_task_set_fiber(). */
+	bool isFiber;
+	/** Coroutine of a started fiber task. */
+	struct coro *coro;
+	/** Thread the fiber is pinned to. */
+	struct poolWorker *owner;
+	/** FIBER_* reason of the last switch back to the thread. */
+	int fiberIntent;
+	/** WAKE_* handshake of suspend and resume. */
+	atomic_uint wakeState;
+	/** Run time so far, a fiber runs in several slices. */
+	uint64_t runNs;
+	/** Expected run time in seconds, 0 if unknown. */
+	double cost;
+};
+
+/**
+ * Group state word layout: the low 12 bits count sleeping waiters,
+ * the high 20 bits count tasks which are pushed but not finished
+ * yet, enough for 10 full pools. The waiter count is capped at the
+ * mask, so it never carries into the pending count. Waiters above
+ * the cap are not counted and poll instead of sleeping on the word.
+ */
+enum {
+	GROUP_WAITER_MASK = 0xfff,
+	GROUP_PENDING_ONE = 0x1000,
+	/** How often a not counted waiter checks the group. */
+	GROUP_POLL_NS = 1000000,
+};
+
+struct thread_task_group {
+	/** Pending tasks and waiters, also used as a futex word. */
+	atomic_uint state;
+	/** Finished tasks in LIFO order, pushed by workers. */
+	_Atomic(struct thread_task *) done;
+	/** Finished tasks in completion order, owned by waiters. */
+	struct thread_task *ready;
+	struct thread_task *readyLast;
+	pthread_mutex_t readyMutex;
+};
+
+/**
+ * Finished tasks in completion order. Workers push into a
+ * lock-free LIFO and touch the eventfd only when it was empty, so
+ * a burst of completions costs one wakeup. Blocking pops sleep in
+ * poll() on the same eventfd.
+ */
+struct thread_completion {
+	_Atomic(struct thread_task *) done;
+	/** Drained but not returned yet, in completion order. */
+	struct thread_task *ready;
+	struct thread_task *readyLast;
+	pthread_mutex_t readyMutex;
+	int fd;
+	/** Tasks pushed and not popped yet. */
+	atomic_int pendingCount;
+};
+
+/** FIFO of tasks of one priority. */
+struct taskLane {
+	struct thread_task *head;
+	struct thread_task *tail;
+	/** Written under the queue mutex, read without it. */
+	atomic_int depth;
+	/** Pops served by higher lanes while this one waited. */
+	int skipCount;
+};
+
+/**
+ * Tasks of one NUMA node, or the shared ones which any thread can
+ * take. Threads live at one queue, but take tasks from the shared
+ * one and steal from other nodes when their own is empty. All is
+ * protected by the pool mutex.
+ */
+struct taskQueue {
+	struct taskLane lanes[TPOOL_PRIO_COUNT];
+	/** Tasks in all the lanes. */
+	int depth;
+	/** Threads living here. */
+	int threadCount;
+	/**
+	 * Threads living here which do not run a task - spinning,
+	 * parked, or just finishing one. Atomic so as a worker is
+	 * counted before it publishes a result, and a push right
+	 * after a join sees it.
+	 */
+	atomic_int idleCount;
+	/** Threads sleeping on cond. */
+	int parkedCount;
+	pthread_cond_t cond;
+};
+
+/** CPUs a thread can be pinned to: a core, a node, or a user set. */
+struct cpuGroup {
+	int *cpus;
+	int count;
+};
+
+typedef enum {
+	/** No thread, the slot can be used for a new one. */
+	WFREE,
+	/** The thread works or looks for work. */
+	WALIVE,
+	/** The thread has exited and needs to be joined. */
+	WDEAD,
+} WorkerStatus_t;
+
+/**
+ * Counters of one thread. Only the owner writes them, so updates
+ * are plain relaxed load + store, and readers aggregate them
+ * without stopping the thread.
+ */
+struct workerStats {
+	_Atomic uint64_t completed;
+	_Atomic uint64_t parkCount;
+	_Atomic uint64_t busyNs;
+	_Atomic uint64_t idleNs;
+	/** Tasks dropped because of their deadline. */
+	_Atomic uint64_t expireCount;
+	_Atomic uint64_t waitHist[TPOOL_HIST_BUCKETS];
+	_Atomic uint64_t execHist[TPOOL_HIST_BUCKETS];
+};
+
+struct poolWorker {
+	/** Own cache lines, so as threads do not share them on updates. */
+	_Alignas(64) struct workerStats stats;
+	/** When the thread started, for its idle time. */
+	uint64_t startTime;
+	pthread_t thread;
+	struct thread_pool *pool;
+	WorkerStatus_t status;
+	/** Index of the queue the thread lives at. */
+	int home;
+	/**
+	 * Fibers started by this thread and resumed or yielded, ready
+	 * to continue. Protected by the pool mutex, linked by next.
+	 */
+	struct thread_task *fiberHead;
+	struct thread_task *fiberTail;
+	/** Length of the fiber list, read without the mutex. */
+	atomic_int fiberReadyCount;
+	/** Not finished fibers of this thread. Owned by the thread. */
+	int fiberCount;
+	/** Ready fibers and queued tasks take turns. */
+	bool isFiberTurn;
+	/** The thread has coro_sched_init() done. */
+	bool hasCoroSched;
+};
+
+struct thread_pool {
+	struct poolWorker *workers;
+	/** Allocation the aligned workers array lives in. */
+	void *workersMem;
+
+	/** Alive threads. Changed under the mutex, read without it. */
+	atomic_int createdThreadCount;
+	atomic_int taskCount;
+	int maxThreads;
+	/** Limit of taskCount. */
+	int maxTasks;
+	/** Producers sleeping on notFullCond. Changed under the mutex. */
+	atomic_int pushWaiterCount;
+	pthread_cond_t notFullCond;
+	/** Stats of exited threads. Protected by the mutex. */
+	struct workerStats retiredStats;
+	uint64_t spawnCount;
+	/** Tasks cancelled by users. Not on the hot path. */
+	_Atomic uint64_t cancelCount;
+	/** NULL unless the pool reports completions. */
+	struct thread_completion *completion;
+	/** Policies of running tasks outside of pool threads. */
+	bool callerRuns;
+	double inlineCost;
+	bool joinHelps;
+	/** Tasks run and dropped outside of pool threads. */
+	_Atomic uint64_t callerRunCount;
+	_Atomic uint64_t callerExpireCount;
+	/** Idle time after which a thread exits, 0 for never. */
+	double idleTimeout;
+	/** Queue polls of an idle thread before it parks. */
+	int spinCount;
+	/** The shared queue and then one per NUMA node, if any. */
+	struct taskQueue *queues;
+	int queueCount;
+	/**
+	 * Total number of queued tasks in all queues. Changed under
+	 * the mutex, read without it by spinning threads.
+	 */
+	atomic_int queuedCount;
+	/** One of TPOOL_PLACE_*. */
+	int placement;
+	/** Affinity sets - user's one, cores, or nodes. */
+	struct cpuGroup *cpuGroups;
+	int cpuGroupCount;
+	pthread_mutex_t currentMutex;
+	bool exit;
+};
+
+static inline ThreadStatus_t taskStatus(unsigned state) {
+	return state & TASK_STATUS_MASK;
+}
+
+static void futexWait(atomic_uint *addr, unsigned expected) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futexWake(atomic_uint *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/** Absolute CLOCK_MONOTONIC time @a timeout seconds from now. */
+static void deadlineAfter(struct timespec *deadline, double timeout) {
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	double sec = deadline->tv_sec + deadline->tv_nsec / 1e9 + timeout;
+	deadline->tv_sec = (time_t)sec;
+	deadline->tv_nsec = (long)((sec - deadline->tv_sec) * 1e9);
+}
+
+static uint64_t nowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Add to a counter which has only one writer. */
+static inline void counterAdd(_Atomic uint64_t *counter, uint64_t value) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+			      memory_order_relaxed);
+}
+
+static inline uint64_t counterGet(_Atomic uint64_t *counter) {
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/**
+ * Log-linear histogram bucket: values below 4 are exact, then each
+ * power of two is split into 4 sub-buckets, which keeps the error
+ * within 25%. The last bucket takes everything bigger.
+ */
+static int histBucket(uint64_t value) {
+	if (value < 4) {
+		return (int)value;
+	}
+	int exp = 63 - __builtin_clzll(value);
+	int bucket = (exp - 1) * 4 + (int)((value >> (exp - 2)) & 3);
+	return bucket < TPOOL_HIST_BUCKETS ? bucket : TPOOL_HIST_BUCKETS - 1;
+}
+
+/** Add up counters of @a src into @a dst. */
+static void statsAdd(struct workerStats *dst, struct workerStats *src) {
+	counterAdd(&dst->completed, counterGet(&src->completed));
+	counterAdd(&dst->parkCount, counterGet(&src->parkCount));
+	counterAdd(&dst->busyNs, counterGet(&src->busyNs));
+	counterAdd(&dst->idleNs, counterGet(&src->idleNs));
+	counterAdd(&dst->expireCount, counterGet(&src->expireCount));
+	for (int i = 0; i < TPOOL_HIST_BUCKETS; ++i) {
+		counterAdd(&dst->waitHist[i], counterGet(&src->waitHist[i]));
+		counterAdd(&dst->execHist[i], counterGet(&src->execHist[i]));
+	}
+}
+
+static inline void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+/**
+ * Pick a lane to pop from. Higher lanes go first, but a lower
+ * non-empty lane skipped TPOOL_PRIO_AGING times wins, so as bulk
+ * work is not starved by a constant stream of urgent tasks.
+ */
+static struct taskLane *queueChooseLane(struct taskQueue *queue) {
+	int top = 0;
+	while (top < TPOOL_PRIO_COUNT && queue->lanes[top].head == NULL) {
+		++top;
+	}
+	if (top == TPOOL_PRIO_COUNT) {
+		return NULL;
+	}
+	int chosen = top;
+	for (int i = TPOOL_PRIO_COUNT - 1; i > top; --i) {
+		if (queue->lanes[i].head != NULL && queue->lanes[i].skipCount >= TPOOL_PRIO_AGING) {
+			chosen = i;
+			break;
+		}
+	}
+	for (int i = top; i < TPOOL_PRIO_COUNT; ++i) {
+		if (i != chosen && queue->lanes[i].head != NULL) {
+			++queue->lanes[i].skipCount;
+		}
+	}
+	queue->lanes[chosen].skipCount = 0;
+	return &queue->lanes[chosen];
+}
+
+/** Pop the next task of one queue. Must be called under currentMutex. */
+static struct thread_task *queuePopFrom(struct thread_pool *pool, struct taskQueue *queue) {
+	struct taskLane *lane = queueChooseLane(queue);
+	if (lane == NULL) {
+		return NULL;
+	}
+	struct thread_task *tp = lane->head;
+	lane->head = tp->next;
+	if (lane->head != NULL) {
+		lane->head->prev = NULL;
+	} else {
+		lane->tail = NULL;
+	}
+	atomic_store_explicit(&lane->depth, lane->depth - 1, memory_order_relaxed);
+	--queue->depth;
+	atomic_store_explicit(&pool->queuedCount, pool->queuedCount - 1, memory_order_relaxed);
+	tp->next = NULL;
+	tp->prev = NULL;
+	tp->isQueued = false;
+	return tp;
+}
+
+/**
+ * Unlink a task from the middle of its lane. Returns false if it
+ * is not queued - not pushed, waits for dependencies, or already
+ * taken by a thread. Must be called under currentMutex.
+ */
+static bool queueRemove(struct thread_pool *pool, struct thread_task *task) {
+	if (!task->isQueued) {
+		return false;
+	}
+	struct taskQueue *queue = &pool->queues[task->queueIndex];
+	struct taskLane *lane = &queue->lanes[task->priority];
+	if (task->prev != NULL) {
+		task->prev->next = task->next;
+	} else {
+		lane->head = task->next;
+	}
+	if (task->next != NULL) {
+		task->next->prev = task->prev;
+	} else {
+		lane->tail = task->prev;
+	}
+	atomic_store_explicit(&lane->depth, lane->depth - 1, memory_order_relaxed);
+	--queue->depth;
+	atomic_store_explicit(&pool->queuedCount, pool->queuedCount - 1, memory_order_relaxed);
+	task->next = NULL;
+	task->prev = NULL;
+	task->isQueued = false;
+	return true;
+}
+
+/**
+ * Pop the next task for a thread living at queue @a home: its own
+ * tasks go first, then the shared ones, then the other nodes'.
+ * Must be called under currentMutex.
+ */
+static struct thread_task *queuePop(struct thread_pool *pool, int home) {
+	if (pool->queuedCount == 0) {
+		return NULL;
+	}
+	struct thread_task *tp = queuePopFrom(pool, &pool->queues[home]);
+	if (tp == NULL && home != 0) {
+		tp = queuePopFrom(pool, &pool->queues[0]);
+	}
+	for (int i = 1; tp == NULL && i < pool->queueCount; ++i) {
+		tp = queuePopFrom(pool, &pool->queues[i]);
+	}
+	return tp;
+}
+
+/** Append to the tail of the task's lane. Must be called under currentMutex. */
+static void queuePush(struct thread_pool *pool, struct thread_task *task) {
+	struct taskQueue *queue = &pool->queues[task->queueIndex];
+	struct taskLane *lane = &queue->lanes[task->priority];
+	task->next = NULL;
+	task->prev = lane->tail;
+	if (lane->tail != NULL) {
+		lane->tail->next = task;
+	} else {
+		lane->head = task;
+	}
+	lane->tail = task;
+	task->isQueued = true;
+	atomic_store_explicit(&lane->depth, lane->depth + 1, memory_order_relaxed);
+	++queue->depth;
+	atomic_store_explicit(&pool->queuedCount, pool->queuedCount + 1, memory_order_relaxed);
+}
+
+/**
+ * Parse a CPU list file of /sys like "0-3,8,10-11". Returns CPU
+ * count, 0 on any error.
+ */
+static int cpuListRead(const char *path, int **cpus) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	char buf[4096];
+	bool ok = fgets(buf, sizeof(buf), f) != NULL;
+	fclose(f);
+	if (!ok) {
+		return 0;
+	}
+	int count = 0;
+	int capacity = 0;
+	*cpus = NULL;
+	char *pos = buf;
+	while (*pos != 0 && *pos != '\n') {
+		char *end;
+		long first = strtol(pos, &end, 10);
+		long last = first;
+		if (end == pos) {
+			break;
+		}
+		if (*end == '-') {
+			pos = end + 1;
+			last = strtol(pos, &end, 10);
+		}
+		for (long cpu = first; cpu <= last; ++cpu) {
+			if (count == capacity) {
+				capacity = capacity == 0 ? 16 : capacity * 2;
+				*cpus = realloc(*cpus, capacity * sizeof(int));
+			}
+			(*cpus)[count++] = (int)cpu;
+		}
+		pos = *end == ',' ? end + 1 : end;
+	}
+	if (count == 0) {
+		free(*cpus);
+		*cpus = NULL;
+	}
+	return count;
+}
+
+static int cmpInt(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+static void cpuGroupAdd(struct thread_pool *pool, int *cpus, int count) {
+	pool->cpuGroups = realloc(pool->cpuGroups, (pool->cpuGroupCount + 1) * sizeof(struct cpuGroup));
+	pool->cpuGroups[pool->cpuGroupCount].cpus = cpus;
+	pool->cpuGroups[pool->cpuGroupCount].count = count;
+	++pool->cpuGroupCount;
+}
+
+/** A group per physical core, hyperthreads of a core are in one. */
+static void cpuGroupsReadCores(struct thread_pool *pool) {
+	int *online;
+	int count = cpuListRead("/sys/devices/system/cpu/online", &online);
+	for (int i = 0; i < count; ++i) {
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+			 online[i]);
+		int *siblings;
+		int siblingCount = cpuListRead(path, &siblings);
+		if (siblingCount == 0) {
+			siblings = malloc(sizeof(int));
+			siblings[0] = online[i];
+			siblingCount = 1;
+		}
+		/* The core is added by its first hyperthread only. */
+		if (siblings[0] != online[i]) {
+			free(siblings);
+			continue;
+		}
+		cpuGroupAdd(pool, siblings, siblingCount);
+	}
+	free(online);
+}
+
+/** A group per NUMA node, in the order of node numbers. */
+static void cpuGroupsReadNodes(struct thread_pool *pool) {
+	DIR *dir = opendir("/sys/devices/system/node");
+	int *nodes = NULL;
+	int nodeCount = 0;
+	struct dirent *entry;
+	while (dir != NULL && (entry = readdir(dir)) != NULL) {
+		int node;
+		char tail;
+		if (sscanf(entry->d_name, "node%d%c", &node, &tail) != 1) {
+			continue;
+		}
+		nodes = realloc(nodes, (nodeCount + 1) * sizeof(int));
+		nodes[nodeCount++] = node;
+	}
+	if (dir != NULL) {
+		closedir(dir);
+	}
+	qsort(nodes, nodeCount, sizeof(int), cmpInt);
+	for (int i = 0; i < nodeCount; ++i) {
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+		int *cpus;
+		int count = cpuListRead(path, &cpus);
+		/* Memory-only nodes have no CPUs to run threads on. */
+		if (count > 0) {
+			cpuGroupAdd(pool, cpus, count);
+		}
+	}
+	free(nodes);
+	if (pool->cpuGroupCount == 0) {
+		/* Not a NUMA kernel - the whole machine is one node. */
+		int *cpus;
+		int count = cpuListRead("/sys/devices/system/cpu/online", &cpus);
+		if (count > 0) {
+			cpuGroupAdd(pool, cpus, count);
+		}
+	}
+}
+
+/**
+ * Hand a finished task over to its group. The state word is the
+ * last thing touched, so the group can be deleted as soon as a
+ * waiter sees no pending tasks.
+ */
+static void groupNotify(struct thread_task_group *group, struct thread_task *tp) {
+	struct thread_task *head = atomic_load_explicit(&group->done, memory_order_relaxed);
+	do {
+		tp->groupNext = head;
+	} while (!atomic_compare_exchange_weak(&group->done, &head, tp));
+	unsigned old = atomic_fetch_sub(&group->state, GROUP_PENDING_ONE);
+	if (old & GROUP_WAITER_MASK) {
+		futexWake(&group->state);
+	}
+}
+
+/**
+ * Move the tasks finished so far to the ready list, restoring the
+ * completion order. Must be called under readyMutex.
+ */
+static void groupCollect(struct thread_task_group *group) {
+	struct thread_task *tp = atomic_exchange(&group->done, NULL);
+	struct thread_task *reversed = NULL;
+	struct thread_task *last = tp;
+	while (tp != NULL) {
+		struct thread_task *next = tp->groupNext;
+		tp->groupNext = reversed;
+		reversed = tp;
+		tp = next;
+	}
+	if (reversed == NULL) {
+		return;
+	}
+	if (group->readyLast != NULL) {
+		group->readyLast->groupNext = reversed;
+	} else {
+		group->ready = reversed;
+	}
+	group->readyLast = last;
+}
+
+static void completionNotify(struct thread_completion *completion, struct thread_task *tp) {
+	struct thread_task *head = atomic_load_explicit(&completion->done, memory_order_relaxed);
+	do {
+		tp->completionNext = head;
+	} while (!atomic_compare_exchange_weak(&completion->done, &head, tp));
+	/* Not empty means the fd is signaled already and not drained yet. */
+	if (head == NULL) {
+		uint64_t one = 1;
+		write(completion->fd, &one, sizeof(one));
+	}
+}
+
+/**
+ * Move finished tasks to the ready list. The eventfd is reset
+ * before the list is taken, so a task pushed in between signals it
+ * again instead of being missed. Must be called under readyMutex.
+ */
+static void completionCollect(struct thread_completion *completion) {
+	uint64_t value;
+	read(completion->fd, &value, sizeof(value));
+	struct thread_task *tp = atomic_exchange(&completion->done, NULL);
+	struct thread_task *reversed = NULL;
+	struct thread_task *last = tp;
+	while (tp != NULL) {
+		struct thread_task *next = tp->completionNext;
+		tp->completionNext = reversed;
+		reversed = tp;
+		tp = next;
+	}
+	if (reversed == NULL) {
+		return;
+	}
+	if (completion->readyLast != NULL) {
+		completion->readyLast->completionNext = reversed;
+	} else {
+		completion->ready = reversed;
+	}
+	completion->readyLast = last;
+}
+
+/**
+ * Take up to @a count finished tasks without waiting. Returns how
+ * many are taken.
+ */
+static int completionTake(struct thread_completion *completion, struct thread_task **tasks,
+			  int count) {
+	pthread_mutex_lock(&completion->readyMutex);
+	completionCollect(completion);
+	int taken = 0;
+	struct thread_task *tp = completion->ready;
+	while (tp != NULL && taken < count) {
+		struct thread_task *next = tp->completionNext;
+		tp->completionNext = NULL;
+		tp->completion = NULL;
+		tasks[taken++] = tp;
+		tp = next;
+	}
+	completion->ready = tp;
+	atomic_fetch_sub_explicit(&completion->pendingCount, taken, memory_order_relaxed);
+	if (tp == NULL) {
+		completion->readyLast = NULL;
+	} else {
+		/* Keep the fd readable while something is left. */
+		uint64_t one = 1;
+		write(completion->fd, &one, sizeof(one));
+	}
+	pthread_mutex_unlock(&completion->readyMutex);
+	return taken;
+}
+
+/**
+ * Wait for at least one finished task and take up to @a count of
+ * them. @a deadline NULL means no timeout.
+ */
+static int completionWait(struct thread_completion *completion, struct thread_task **tasks,
+			  int count, const struct timespec *deadline, int *taken) {
+	while (true) {
+		/*
+		 * Pending is read before the list is taken, and a task is
+		 * in the list before it is popped and un-counted. So zero
+		 * pending and nothing taken means really nothing.
+		 */
+		int pending = atomic_load(&completion->pendingCount);
+		*taken = completionTake(completion, tasks, count);
+		if (*taken > 0) {
+			return 0;
+		}
+		if (pending == 0) {
+			return TPOOL_ERR_NO_TASKS;
+		}
+		struct timespec timeout = {0, 0};
+		if (deadline != NULL) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int64_t ns = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000000000 +
+				     (deadline->tv_nsec - now.tv_nsec);
+			if (ns <= 0) {
+				return TPOOL_ERR_TIMEOUT;
+			}
+			timeout.tv_sec = ns / 1000000000;
+			timeout.tv_nsec = ns % 1000000000;
+		}
+		/* The fd is reset by the take above, a new task signals it. */
+		struct pollfd pfd = {.fd = completion->fd, .events = POLLIN};
+		ppoll(&pfd, 1, deadline != NULL ? &timeout : NULL, NULL);
+	}
+}
+
+/** Count a waiter in the group state. False if the count is full. */
+static bool groupWaiterAdd(struct thread_task_group *group) {
+	unsigned state = atomic_load(&group->state);
+	do {
+		if ((state & GROUP_WAITER_MASK) == GROUP_WAITER_MASK) {
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak(&group->state, &state, state + 1));
+	return true;
+}
+
+/**
+ * Sleep until the group state changes from @a state. A not counted
+ * waiter would not be woken up, so it only naps.
+ */
+static void groupWait(struct thread_task_group *group, unsigned state, bool isWaiter) {
+	if (isWaiter) {
+		futexWait(&group->state, state);
+		return;
+	}
+	struct timespec nap = {.tv_sec = 0, .tv_nsec = GROUP_POLL_NS};
+	nanosleep(&nap, NULL);
+}
+
+static void *threadRunner(void *voidWorker);
+
+/**
+ * Start one more thread living at queue @a home, if the limit
+ * allows. Must be called under currentMutex.
+ */
+static bool poolSpawn(struct thread_pool *pool, int home) {
+	if (pool->createdThreadCount >= pool->maxThreads) {
+		return false;
+	}
+	int slot = 0;
+	while (pool->workers[slot].status == WALIVE) {
+		++slot;
+	}
+	struct poolWorker *worker = &pool->workers[slot];
+	/* A retired thread has unlocked the mutex already, join is quick. */
+	if (worker->status == WDEAD) {
+		pthread_join(worker->thread, NULL);
+		worker->status = WFREE;
+	}
+	worker->pool = pool;
+	worker->home = home;
+	/* The previous thread of the slot has folded its stats. */
+	memset(&worker->stats, 0, sizeof(worker->stats));
+	worker->startTime = nowNs();
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (pool->cpuGroupCount > 0) {
+		/*
+		 * Node threads are pinned to their node, the others take
+		 * cores or the user set by turns.
+		 */
+		int group = home != 0 ? home - 1 : slot % pool->cpuGroupCount;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int i = 0; i < pool->cpuGroups[group].count; ++i) {
+			CPU_SET(pool->cpuGroups[group].cpus[i], &set);
+		}
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+	int rc = pthread_create(&worker->thread, &attr, threadRunner, worker);
+	pthread_attr_destroy(&attr);
+	if (rc != 0) {
+		return false;
+	}
+	worker->status = WALIVE;
+	++pool->spawnCount;
+	atomic_store_explicit(&pool->createdThreadCount, pool->createdThreadCount + 1, memory_order_relaxed);
+	++pool->queues[home].threadCount;
+	++pool->queues[home].idleCount;
+	return true;
+}
+
+/** Choose where a new thread for shared tasks lives - the emptiest node. */
+static int poolSpawnHome(struct thread_pool *pool) {
+	int home = 0;
+	for (int i = 1; i < pool->queueCount; ++i) {
+		if (home == 0 || pool->queues[i].threadCount < pool->queues[home].threadCount) {
+			home = i;
+		}
+	}
+	return home;
+}
+
+/**
+ * Find a thread for a task just queued into @a queue. A parked
+ * thread of that queue is woken up first. For node tasks a node
+ * thread is started when the node queue is deeper than its idle
+ * threads. Otherwise any parked thread can take or steal it, and
+ * a new one is started only when all the queues together are
+ * deeper than the number of idle threads. Spinning threads find
+ * the task themselves. Must be called under currentMutex.
+ */
+static void poolWake(struct thread_pool *pool, int queueIndex) {
+	struct taskQueue *queue = &pool->queues[queueIndex];
+	if (queue->parkedCount > 0) {
+		pthread_cond_signal(&queue->cond);
+		return;
+	}
+	if (queueIndex != 0 && queue->depth > queue->idleCount && poolSpawn(pool, queueIndex)) {
+		return;
+	}
+	int idleCount = 0;
+	for (int i = 0; i < pool->queueCount; ++i) {
+		if (pool->queues[i].parkedCount > 0) {
+			pthread_cond_signal(&pool->queues[i].cond);
+			return;
+		}
+		idleCount += pool->queues[i].idleCount;
+	}
+	if (pool->queuedCount > idleCount) {
+		poolSpawn(pool, poolSpawnHome(pool));
+	}
+}
+
+static void poolEnqueue(struct thread_pool *pool, struct thread_task *task) {
+	task->queueTime = nowNs();
+	pthread_mutex_lock(&pool->currentMutex);
+	queuePush(pool, task);
+	poolWake(pool, task->queueIndex);
+	pthread_mutex_unlock(&pool->currentMutex);
+}
+
+/**
+ * Drop one dependency of @a task. Returns true, if it was the last
+ * one and the task is runnable now. The counter gets its push
+ * reference back for the next use of the task.
+ */
+static bool taskDepRelease(struct thread_task *task) {
+	if (atomic_fetch_sub(&task->depCount, 1) != 1) {
+		return false;
+	}
+	atomic_store_explicit(&task->depCount, 1, memory_order_relaxed);
+	return true;
+}
+
+/**
+ * Release successors of a finished task. All the runnable ones
+ * except the first are queued, the first is returned so as the
+ * caller could run it right away.
+ */
+static struct thread_task *taskReleaseSuccessors(struct thread_task *tp) {
+	struct thread_task *next = NULL;
+	for (int i = 0; i < tp->successorCount; ++i) {
+		struct thread_task *succ = tp->successors[i];
+		if (!taskDepRelease(succ)) {
+			continue;
+		}
+		if (next == NULL && succ->pool == tp->pool) {
+			succ->queueTime = nowNs();
+			next = succ;
+		} else {
+			poolEnqueue(succ->pool, succ);
+		}
+	}
+	/* Edges are one-shot, the array is kept for reuse. */
+	tp->successorCount = 0;
+	return next;
+}
+
+/**
+ * Publish the result of a finished task. Nothing is locked here:
+ * a single fetch_add flips the status, and the futex is touched
+ * only when a joiner announced that it sleeps. Returns a successor
+ * which became runnable and is not queued.
+ */
+static struct thread_task *taskComplete(struct thread_task *tp) {
+	/* Successors go first - once finished, the task can be freed. */
+	struct thread_task *next = taskReleaseSuccessors(tp);
+	struct thread_task_group *group = tp->group;
+	/*
+	 * Completions too, so as a joined task is already drainable.
+	 * The drainer may see the task a moment before it is finished.
+	 */
+	if (tp->completion != NULL) {
+		completionNotify(tp->completion, tp);
+	}
+	unsigned old = atomic_fetch_add(&tp->state, 1);
+	if (old & TASK_DETACHED) {
+		atomic_store_explicit(&tp->state, TINIT, memory_order_relaxed);
+		thread_task_delete(tp);
+		return next;
+	}
+	/*
+	 * The joiner may have already seen TFINISHED and freed the
+	 * task. A wake on a stale address is harmless for a private
+	 * futex - at most a spurious wakeup for someone else.
+	 */
+	if (old & TASK_HAS_WAITER) {
+		futexWake(&tp->state);
+	}
+	/*
+	 * Grouped tasks can not be detached or deleted until the group
+	 * returns them, so the task is still alive here even if it was
+	 * joined in between.
+	 */
+	if (group != NULL) {
+		groupNotify(group, tp);
+	}
+	return next;
+}
+
+/** The task is held by a group or a completion queue. */
+static inline bool taskIsHeld(const struct thread_task *task) {
+	return task->group != NULL || task->completion != NULL;
+}
+
+/** Take a slot in the pool task limit, if there is a free one. */
+static bool poolTryReserve(struct thread_pool *pool) {
+	int count = atomic_load(&pool->taskCount);
+	do {
+		if (count >= pool->maxTasks) {
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak(&pool->taskCount, &count, count + 1));
+	return true;
+}
+
+/**
+ * Sleep until a slot in the pool task limit is free and take it.
+ * @a deadline NULL means no timeout.
+ */
+static int poolReserveWait(struct thread_pool *pool, const struct timespec *deadline) {
+	int rc = 0;
+	pthread_mutex_lock(&pool->currentMutex);
+	/*
+	 * The waiter is announced before the limit is checked again,
+	 * and a finishing task drops the count before checking for
+	 * waiters, so at least one of them sees the other.
+	 */
+	++pool->pushWaiterCount;
+	while (!poolTryReserve(pool)) {
+		if (rc == ETIMEDOUT) {
+			rc = TPOOL_ERR_TIMEOUT;
+			break;
+		}
+		if (deadline != NULL) {
+			rc = pthread_cond_timedwait(&pool->notFullCond, &pool->currentMutex, deadline);
+		} else {
+			pthread_cond_wait(&pool->notFullCond, &pool->currentMutex);
+		}
+	}
+	if (rc == ETIMEDOUT) {
+		rc = 0;
+	}
+	--pool->pushWaiterCount;
+	pthread_mutex_unlock(&pool->currentMutex);
+	return rc;
+}
+
+/** Give back a slot of a task which left the pool. */
+static void poolRelease(struct thread_pool *pool) {
+	--pool->taskCount;
+	if (atomic_load(&pool->pushWaiterCount) != 0) {
+		pthread_mutex_lock(&pool->currentMutex);
+		pthread_cond_signal(&pool->notFullCond);
+		pthread_mutex_unlock(&pool->currentMutex);
+	}
+}
+
+/**
+ * Wait for tasks. The queue is polled for a while without the
+ * mutex, and only then the thread parks on the condition. Must be
+ * called under currentMutex, returns with it locked. Returns false
+ * if the thread has been idle for too long and should exit.
+ */
+static bool workerIdle(struct poolWorker *worker) {
+	struct thread_pool *pool = worker->pool;
+	struct taskQueue *home = &pool->queues[worker->home];
+	pthread_mutex_unlock(&pool->currentMutex);
+	for (int i = 0; i < pool->spinCount; ++i) {
+		if (atomic_load_explicit(&pool->queuedCount, memory_order_relaxed) != 0 ||
+		    atomic_load_explicit(&worker->fiberReadyCount, memory_order_relaxed) != 0) {
+			break;
+		}
+		if (i < pool->spinCount / 2) {
+			cpuRelax();
+		} else {
+			sched_yield();
+		}
+	}
+	pthread_mutex_lock(&pool->currentMutex);
+	if (pool->queuedCount != 0 || worker->fiberHead != NULL || pool->exit) {
+		return true;
+	}
+	int rc = 0;
+	counterAdd(&worker->stats.parkCount, 1);
+	++home->parkedCount;
+	if (pool->idleTimeout > 0) {
+		struct timespec deadline;
+		deadlineAfter(&deadline, pool->idleTimeout);
+		rc = pthread_cond_timedwait(&home->cond, &pool->currentMutex, &deadline);
+	} else {
+		pthread_cond_wait(&home->cond, &pool->currentMutex);
+	}
+	--home->parkedCount;
+	/* A thread with suspended fibers can't exit, they are pinned to it. */
+	return rc != ETIMEDOUT || pool->queuedCount != 0 || pool->exit || worker->fiberCount != 0;
+}
+
+/** The task being run by this thread, if any. */
+static __thread struct thread_task *currentTask;
+/** The pool thread this is, if any. */
+static __thread struct poolWorker *currentWorker;
+
+/** Put a fiber into the ready list of its thread. Must be called under currentMutex. */
+static void fiberReady(struct thread_task *tp) {
+	struct poolWorker *worker = tp->owner;
+	tp->next = NULL;
+	if (worker->fiberTail != NULL) {
+		worker->fiberTail->next = tp;
+	} else {
+		worker->fiberHead = tp;
+	}
+	worker->fiberTail = tp;
+	atomic_store_explicit(&worker->fiberReadyCount, worker->fiberReadyCount + 1,
+			      memory_order_relaxed);
+}
+
+/**
+ * Wake a suspended fiber. Threads of a queue park on one
+ * condition, so all of them are woken to be sure the owner is.
+ */
+static void fiberSchedule(struct thread_task *tp) {
+	struct thread_pool *pool = tp->pool;
+	struct taskQueue *home = &pool->queues[tp->owner->home];
+	pthread_mutex_lock(&pool->currentMutex);
+	fiberReady(tp);
+	if (home->parkedCount > 0) {
+		pthread_cond_broadcast(&home->cond);
+	}
+	pthread_mutex_unlock(&pool->currentMutex);
+}
+
+/** Take the next task, a queued one or a ready fiber. Must be called under currentMutex. */
+static struct thread_task *workerPop(struct poolWorker *worker) {
+	worker->isFiberTurn = !worker->isFiberTurn;
+	if (!worker->isFiberTurn || worker->fiberHead == NULL) {
+		struct thread_task *tp = queuePop(worker->pool, worker->home);
+		if (tp != NULL) {
+			return tp;
+		}
+	}
+	struct thread_task *tp = worker->fiberHead;
+	if (tp != NULL) {
+		worker->fiberHead = tp->next;
+		if (worker->fiberHead == NULL) {
+			worker->fiberTail = NULL;
+		}
+		tp->next = NULL;
+		atomic_store_explicit(&worker->fiberReadyCount, worker->fiberReadyCount - 1,
+				      memory_order_relaxed);
+	}
+	return tp;
+}
+
+static int fiberBody(void *arg) {
+	struct thread_task *tp = arg;
+	tp->result = tp->function(tp->arg);
+	return 0;
+}
+
+/**
+ * Run a fiber until it finishes or switches out. Returns false if
+ * it is not finished, then it is either in the ready list or
+ * suspended.
+ */
+static bool fiberRun(struct poolWorker *worker, struct thread_task *tp) {
+	coro_resume(tp->coro);
+	if (coro_is_finished(tp->coro)) {
+		coro_delete(tp->coro);
+		tp->coro = NULL;
+		--worker->fiberCount;
+		return true;
+	}
+	if (tp->fiberIntent == FIBER_SUSPEND) {
+		unsigned expected = WAKE_NONE;
+		if (atomic_compare_exchange_strong(&tp->wakeState, &expected, WAKE_SUSPENDED)) {
+			return false;
+		}
+		/* Resumed before it managed to sleep. */
+		atomic_store(&tp->wakeState, WAKE_NONE);
+	}
+	pthread_mutex_lock(&worker->pool->currentMutex);
+	fiberReady(tp);
+	pthread_mutex_unlock(&worker->pool->currentMutex);
+	return false;
+}
+
+/**
+ * Run a task taken by workerPop(). Returns false if it is a fiber
+ * which switched out before finishing. A finished task is released
+ * from the pool task count right away.
+ */
+static bool workerRun(struct poolWorker *worker, struct thread_task *tp) {
+	uint64_t start = nowNs();
+	bool isFinished = true;
+	currentTask = tp;
+	if (tp->coro != NULL) {
+		isFinished = fiberRun(worker, tp);
+	} else {
+		counterAdd(&worker->stats.waitHist[histBucket(start - tp->queueTime)], 1);
+		/* TWAITING -> TRUNNING, flags are kept. */
+		unsigned old = atomic_fetch_add(&tp->state, 1);
+		if ((old & TASK_CANCELLED) == 0 && tp->deadline != 0 && start > tp->deadline) {
+			old = atomic_fetch_or(&tp->state, TASK_CANCELLED);
+			counterAdd(&worker->stats.expireCount, 1);
+			old |= TASK_CANCELLED;
+		}
+		if (old & TASK_CANCELLED) {
+			tp->result = NULL;
+			currentTask = NULL;
+			poolRelease(worker->pool);
+			return true;
+		}
+		if (tp->isFiber) {
+			if (!worker->hasCoroSched) {
+				coro_sched_init();
+				worker->hasCoroSched = true;
+			}
+			tp->owner = worker;
+			tp->coro = coro_new(fiberBody, tp);
+			++worker->fiberCount;
+			isFinished = fiberRun(worker, tp);
+		} else {
+			tp->result = tp->function(tp->arg);
+		}
+	}
+	if (isFinished) {
+		poolRelease(worker->pool);
+	}
+	currentTask = NULL;
+	uint64_t slice = nowNs() - start;
+	counterAdd(&worker->stats.busyNs, slice);
+	tp->runNs += slice;
+	return isFinished;
+}
+
+/** Account and publish a task finished by workerRun(). Returns taskComplete(). */
+static struct thread_task *workerFinish(struct poolWorker *worker, struct thread_task *tp) {
+	if ((atomic_load_explicit(&tp->state, memory_order_relaxed) & TASK_CANCELLED) == 0) {
+		counterAdd(&worker->stats.execHist[histBucket(tp->runNs)], 1);
+		counterAdd(&worker->stats.completed, 1);
+	}
+	tp->runNs = 0;
+	return taskComplete(tp);
+}
+
+static void *threadRunner(void *voidWorker) {
+	struct poolWorker *worker = voidWorker;
+	struct thread_pool *pool = worker->pool;
+	struct taskQueue *home = &pool->queues[worker->home];
+	currentWorker = worker;
+	pthread_mutex_lock(&pool->currentMutex);
+	while (true) {
+		struct thread_task *tp = workerPop(worker);
+		if (tp == NULL) {
+			if (pool->exit || !workerIdle(worker)) {
+				break;
+			}
+			continue;
+		}
+		--home->idleCount;
+		pthread_mutex_unlock(&pool->currentMutex);
+		if (tp->isRaw) {
+			tp->function(tp->arg);
+			tp = NULL;
+			++home->idleCount;
+		}
+		/* A successor is run by the same thread without queueing. */
+		while (tp != NULL) {
+			if (!workerRun(worker, tp)) {
+				++home->idleCount;
+				break;
+			}
+			++home->idleCount;
+			tp = workerFinish(worker, tp);
+			if (tp != NULL) {
+				--home->idleCount;
+			}
+		}
+		pthread_mutex_lock(&pool->currentMutex);
+	}
+	--home->idleCount;
+	--home->threadCount;
+	counterAdd(&worker->stats.idleNs,
+		   nowNs() - worker->startTime - counterGet(&worker->stats.busyNs));
+	statsAdd(&pool->retiredStats, &worker->stats);
+	atomic_store_explicit(&pool->createdThreadCount, pool->createdThreadCount - 1, memory_order_relaxed);
+	worker->status = WDEAD;
+	pthread_mutex_unlock(&pool->currentMutex);
+	return NULL;
+}
+
+/** Mark a task pushed to @a pool, but do not queue it. */
+static void taskPrepare(struct thread_pool *pool, struct thread_task *task) {
+	task->pool = pool;
+	if (task->completionTarget != NULL) {
+		task->completion = task->completionTarget;
+	} else {
+		task->completion = task->isHelper ? NULL : pool->completion;
+	}
+	if (task->completion != NULL) {
+		atomic_fetch_add_explicit(&task->completion->pendingCount, 1, memory_order_relaxed);
+	}
+	task->deadline = task->timeout > 0 ? nowNs() + (uint64_t)(task->timeout * 1e9) : 0;
+	atomic_store_explicit(&task->wakeState, WAKE_NONE, memory_order_relaxed);
+	atomic_store(&task->state, TWAITING);
+}
+
+/** Push a task which already has its slot in the task limit. */
+static void poolPushReserved(struct thread_pool *pool, struct thread_task *task) {
+	taskPrepare(pool, task);
+	/* Tasks with not finished dependencies are queued later. */
+	if (taskDepRelease(task)) {
+		poolEnqueue(pool, task);
+	}
+}
+
+/**
+ * Run a runnable task on the current thread, which may be not a
+ * pool one. @a isReserved tells if the task has a slot in the task
+ * limit, pushes run in place do not take one.
+ */
+static void taskRunHere(struct thread_task *tp, bool isReserved) {
+	struct thread_pool *pool = tp->pool;
+	/* TWAITING -> TRUNNING, flags are kept. */
+	unsigned old = atomic_fetch_add(&tp->state, 1);
+	if ((old & TASK_CANCELLED) == 0 && tp->deadline != 0 && nowNs() > tp->deadline) {
+		old = atomic_fetch_or(&tp->state, TASK_CANCELLED) | TASK_CANCELLED;
+		atomic_fetch_add_explicit(&pool->callerExpireCount, 1, memory_order_relaxed);
+	}
+	if (old & TASK_CANCELLED) {
+		tp->result = NULL;
+	} else {
+		struct thread_task *outer = currentTask;
+		currentTask = tp;
+		tp->result = tp->function(tp->arg);
+		currentTask = outer;
+		atomic_fetch_add_explicit(&pool->callerRunCount, 1, memory_order_relaxed);
+	}
+	if (isReserved) {
+		poolRelease(pool);
+	}
+	struct thread_task *next = taskComplete(tp);
+	if (next != NULL) {
+		poolEnqueue(next->pool, next);
+	}
+}
+
+/**
+ * The task can run on the pushing thread: it is a plain one and
+ * does not wait for dependencies.
+ */
+static inline bool taskCanRunHere(const struct thread_task *task) {
+	return !task->isHelper && !task->isFiber && atomic_load(&task->depCount) == 1;
+}
+
+/**
+ * All the threads are started, and the queue backlog is at least
+ * one task per thread, so a new task would wait a whole round.
+ */
+static bool poolIsSaturated(struct thread_pool *pool) {
+	return atomic_load_explicit(&pool->createdThreadCount, memory_order_relaxed) ==
+		       pool->maxThreads &&
+	       atomic_load_explicit(&pool->queuedCount, memory_order_relaxed) >= pool->maxThreads;
+}
+
+static int poolPush(struct thread_pool *pool, struct thread_task *task) {
+	bool canRunHere = taskCanRunHere(task);
+	bool runHere = canRunHere && task->cost > 0 && task->cost < pool->inlineCost;
+	runHere = runHere || (canRunHere && pool->callerRuns && poolIsSaturated(pool));
+	if (!runHere && !poolTryReserve(pool)) {
+		if (!canRunHere || !pool->callerRuns) {
+			return TPOOL_ERR_TOO_MANY_TASKS;
+		}
+		runHere = true;
+	}
+	if (runHere) {
+		taskPrepare(pool, task);
+		taskRunHere(task, false);
+		return 0;
+	}
+	poolPushReserved(pool, task);
+	return 0;
+}
+
+/**
+ * Take a queued task to run on a thread which waits for something
+ * else. Raw entries and fibers need a pool thread and are left,
+ * only a few entries of each lane are looked at.
+ */
+static struct thread_task *poolTakeForeign(struct thread_pool *pool) {
+	if (atomic_load_explicit(&pool->queuedCount, memory_order_relaxed) == 0) {
+		return NULL;
+	}
+	struct thread_task *found = NULL;
+	pthread_mutex_lock(&pool->currentMutex);
+	for (int q = 0; q < pool->queueCount && found == NULL; ++q) {
+		for (int l = 0; l < TPOOL_PRIO_COUNT && found == NULL; ++l) {
+			struct thread_task *tp = pool->queues[q].lanes[l].head;
+			for (int i = 0; i < 8 && tp != NULL; ++i, tp = tp->next) {
+				if (!tp->isRaw && !tp->isFiber) {
+					found = tp;
+					break;
+				}
+			}
+		}
+	}
+	if (found != NULL) {
+		queueRemove(pool, found);
+	}
+	pthread_mutex_unlock(&pool->currentMutex);
+	return found;
+}
+
+/** Set up a zeroed task. */
+static void taskInit(struct thread_task *task, thread_task_f function, void *arg) {
+	task->function = function;
+	task->arg = arg;
+	atomic_init(&task->state, TINIT);
+	atomic_init(&task->depCount, 1);
+	task->priority = TPOOL_PRIO_NORMAL;
+}
+
+/** How many tasks a strand runs before it lets other queue entries go. */
+#define STRAND_BATCH 32
+
+/**
+ * A FIFO of tasks run one at a time. The strand is in the pool
+ * queue as a single raw entry, the runner, only while it has tasks,
+ * and the runner is the only one who runs them. So nobody blocks:
+ * a push to a busy strand just appends to its FIFO.
+ */
+struct thread_strand {
+	struct thread_pool *pool;
+	struct thread_task *head;
+	struct thread_task *tail;
+	/** The runner is queued or running. */
+	bool isScheduled;
+	pthread_mutex_t mutex;
+	struct thread_task runner;
+};
+
+static void *strandRun(void *arg) {
+	struct thread_strand *strand = arg;
+	struct poolWorker *worker = currentWorker;
+	for (int i = 0;; ++i) {
+		pthread_mutex_lock(&strand->mutex);
+		struct thread_task *tp = strand->head;
+		if (tp == NULL) {
+			strand->isScheduled = false;
+			pthread_mutex_unlock(&strand->mutex);
+			return NULL;
+		}
+		strand->head = tp->next;
+		if (strand->head == NULL) {
+			strand->tail = NULL;
+		}
+		pthread_mutex_unlock(&strand->mutex);
+		tp->next = NULL;
+		workerRun(worker, tp);
+		/*
+		 * Leave before the task is published, so as the strand can
+		 * be deleted once its last task is joined. A push from now
+		 * on queues the runner again, the task function is done.
+		 */
+		pthread_mutex_lock(&strand->mutex);
+		bool isLast = strand->head == NULL;
+		if (isLast) {
+			strand->isScheduled = false;
+		}
+		pthread_mutex_unlock(&strand->mutex);
+		struct thread_pool *pool = strand->pool;
+		struct thread_task *next = workerFinish(worker, tp);
+		if (next != NULL) {
+			poolEnqueue(next->pool, next);
+		}
+		/* The strand can be freed already. */
+		if (isLast) {
+			return NULL;
+		}
+		if (i + 1 == STRAND_BATCH) {
+			/* Go to the queue tail. Nothing is touched after, it can run at once. */
+			poolEnqueue(pool, &strand->runner);
+			return NULL;
+		}
+	}
+}
+
+/**
+ * A data-parallel loop. The range is consumed through a shared
+ * cursor: each claim takes a half of the remaining share of one
+ * participant, but not less than the grain. So chunks are large
+ * at first and shrink towards the end, which balances the load
+ * like recursive halving does, with no task per chunk.
+ */
+struct parallelJob {
+	atomic_size_t cursor;
+	size_t end;
+	size_t grain;
+	int participantCount;
+	void *ctx;
+	thread_range_f forFunction;
+	thread_reduce_f reduceFunction;
+	/** Reduce only: identity value and per-participant accumulators. */
+	const void *identity;
+	size_t resultSize;
+	char *accs;
+	atomic_int accCount;
+};
+
+static bool parallelClaim(struct parallelJob *job, size_t *begin, size_t *end) {
+	size_t cursor = atomic_load_explicit(&job->cursor, memory_order_relaxed);
+	size_t chunk;
+	do {
+		if (cursor >= job->end) {
+			return false;
+		}
+		size_t remaining = job->end - cursor;
+		chunk = remaining / (2 * job->participantCount);
+		if (chunk < job->grain) {
+			chunk = job->grain;
+		}
+		if (chunk > remaining) {
+			chunk = remaining;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&job->cursor, &cursor, cursor + chunk,
+							memory_order_relaxed, memory_order_relaxed));
+	*begin = cursor;
+	*end = cursor + chunk;
+	return true;
+}
+
+static void parallelRun(struct parallelJob *job) {
+	size_t begin, end;
+	if (!parallelClaim(job, &begin, &end)) {
+		return;
+	}
+	if (job->forFunction != NULL) {
+		do {
+			job->forFunction(job->ctx, begin, end);
+		} while (parallelClaim(job, &begin, &end));
+		return;
+	}
+	/* An accumulator is taken only by those who got some work. */
+	int slot = atomic_fetch_add_explicit(&job->accCount, 1, memory_order_relaxed);
+	void *acc = job->accs + slot * job->resultSize;
+	memcpy(acc, job->identity, job->resultSize);
+	do {
+		job->reduceFunction(job->ctx, begin, end, acc);
+	} while (parallelClaim(job, &begin, &end));
+}
+
+static void *parallelHelper(void *arg) {
+	parallelRun(arg);
+	return NULL;
+}
+
+/**
+ * Run @a job on the calling thread together with helper tasks of
+ * @a pool. Helpers which were not taken by any thread until the
+ * caller ran out of work are removed from the queue, the rest are
+ * joined.
+ */
+static void parallelExecute(struct thread_pool *pool, struct parallelJob *job,
+			    struct thread_task *helpers, int helperCount) {
+	int pushed = 0;
+	for (; pushed < helperCount; ++pushed) {
+		taskInit(&helpers[pushed], parallelHelper, job);
+		helpers[pushed].isHelper = true;
+		if (poolPush(pool, &helpers[pushed]) != 0) {
+			break;
+		}
+	}
+	parallelRun(job);
+	for (int i = 0; i < pushed; ++i) {
+		pthread_mutex_lock(&pool->currentMutex);
+		bool isRemoved = queueRemove(pool, &helpers[i]);
+		pthread_mutex_unlock(&pool->currentMutex);
+		if (isRemoved) {
+			poolRelease(pool);
+			atomic_store(&helpers[i].state, TINIT);
+			continue;
+		}
+		void *unused;
+		thread_task_join(&helpers[i], &unused);
+	}
+}
+
+/**
+ * Prepare a job for [begin, end) and return how many helpers it
+ * needs besides the caller.
+ */
+static int parallelPrepare(struct thread_pool *pool, struct parallelJob *job, size_t begin,
+			   size_t end, size_t grain) {
+	size_t count = end - begin;
+	int participantCount = pool->maxThreads + 1;
+	if (grain == 0) {
+		/* Let the smallest chunk be 1/8 of a participant's share. */
+		grain = count / (8 * (size_t)participantCount);
+		if (grain == 0) {
+			grain = 1;
+		}
+	}
+	size_t chunkCount = (count + grain - 1) / grain;
+	if (chunkCount < (size_t)participantCount) {
+		participantCount = (int)chunkCount;
+	}
+	atomic_init(&job->cursor, begin);
+	job->end = end;
+	job->grain = grain;
+	job->participantCount = participantCount;
+	atomic_init(&job->accCount, 0);
+	return participantCount - 1;
+}
+
+void
+thread_pool_opts_create(struct thread_pool_opts *opts)
+{
+	opts->max_thread_count = TPOOL_MAX_THREADS;
+	opts->max_task_count = TPOOL_MAX_TASKS;
+	opts->idle_timeout = TPOOL_IDLE_TIMEOUT;
+	opts->spin_count = TPOOL_SPIN_COUNT;
+	opts->placement = TPOOL_PLACE_NONE;
+	opts->cpus = NULL;
+	opts->cpu_count = 0;
+	opts->completion_queue = false;
+	opts->caller_runs = false;
+	opts->inline_cost = 0;
+	opts->join_helps = false;
+}
+
+int
+thread_pool_new_opts(const struct thread_pool_opts *opts, struct thread_pool **pool)
+{
+	if (opts->max_thread_count <= 0 || opts->max_thread_count > TPOOL_OPTS_MAX_THREADS ||
+	    opts->max_task_count <= 0 || opts->idle_timeout < 0 || opts->spin_count < 0 ||
+	    opts->inline_cost < 0 ||
+	    opts->placement < TPOOL_PLACE_NONE || opts->placement > TPOOL_PLACE_NUMA) {
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	if (opts->placement == TPOOL_PLACE_CPUSET) {
+		if (opts->cpus == NULL || opts->cpu_count <= 0) {
+			return TPOOL_ERR_INVALID_ARGUMENT;
+		}
+		for (int i = 0; i < opts->cpu_count; ++i) {
+			if (opts->cpus[i] < 0 || opts->cpus[i] >= CPU_SETSIZE) {
+				return TPOOL_ERR_INVALID_ARGUMENT;
+			}
+		}
+	}
+	struct thread_pool *p = calloc(1, sizeof(struct thread_pool));
+	p->maxThreads = opts->max_thread_count;
+	p->maxTasks = opts->max_task_count;
+	p->idleTimeout = opts->idle_timeout;
+	p->spinCount = opts->spin_count;
+	p->placement = opts->placement;
+	p->callerRuns = opts->caller_runs;
+	p->inlineCost = opts->inline_cost;
+	p->joinHelps = opts->join_helps;
+	/* Worker stats must start at a cache line, malloc does not do it. */
+	size_t align = _Alignof(struct poolWorker);
+	p->workersMem = calloc(1, opts->max_thread_count * sizeof(struct poolWorker) + align - 1);
+	p->workers = (struct poolWorker *)(((uintptr_t)p->workersMem + align - 1) & ~(align - 1));
+	switch (opts->placement) {
+	case TPOOL_PLACE_CPUSET: {
+		int *cpus = malloc(opts->cpu_count * sizeof(int));
+		memcpy(cpus, opts->cpus, opts->cpu_count * sizeof(int));
+		cpuGroupAdd(p, cpus, opts->cpu_count);
+		break;
+	}
+	case TPOOL_PLACE_CORES:
+		cpuGroupsReadCores(p);
+		break;
+	case TPOOL_PLACE_NUMA:
+		cpuGroupsReadNodes(p);
+		break;
+	default:
+		break;
+	}
+	/* Only NUMA placement has per-node queues. */
+	p->queueCount = 1;
+	if (opts->placement == TPOOL_PLACE_NUMA) {
+		p->queueCount += p->cpuGroupCount;
+	}
+	p->queues = calloc(p->queueCount, sizeof(struct taskQueue));
+	pthread_mutex_init(&p->currentMutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	for (int i = 0; i < p->queueCount; ++i) {
+		pthread_cond_init(&p->queues[i].cond, &attr);
+	}
+	pthread_cond_init(&p->notFullCond, &attr);
+	if (opts->completion_queue) {
+		thread_completion_new(&p->completion);
+	}
+	pthread_condattr_destroy(&attr);
+	*pool = p;
+	return 0;
+}
+
+int
+thread_pool_new(int max_thread_count, struct thread_pool **pool)
+{
+	if (max_thread_count > TPOOL_MAX_THREADS) {
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	struct thread_pool_opts opts;
+	thread_pool_opts_create(&opts);
+	opts.max_thread_count = max_thread_count;
+	return thread_pool_new_opts(&opts, pool);
+}
+
+int
+thread_pool_thread_count(const struct thread_pool *pool)
+{
+	return pool->createdThreadCount;
+}
+
+void
+thread_pool_stats(struct thread_pool *pool, struct thread_pool_stats *stats)
+{
+	struct workerStats *sum = calloc(1, sizeof(*sum));
+	pthread_mutex_lock(&pool->currentMutex);
+	uint64_t now = nowNs();
+	statsAdd(sum, &pool->retiredStats);
+	for (int i = 0; i < pool->maxThreads; ++i) {
+		struct poolWorker *worker = &pool->workers[i];
+		if (worker->status != WALIVE) {
+			continue;
+		}
+		statsAdd(sum, &worker->stats);
+		uint64_t busy = counterGet(&worker->stats.busyNs);
+		uint64_t alive = now - worker->startTime;
+		counterAdd(&sum->idleNs, alive > busy ? alive - busy : 0);
+	}
+	stats->thread_count = pool->createdThreadCount;
+	stats->task_count = pool->taskCount;
+	stats->queue_depth = pool->queuedCount;
+	stats->spawn_count = pool->spawnCount;
+	pthread_mutex_unlock(&pool->currentMutex);
+	stats->completed = counterGet(&sum->completed);
+	stats->cancel_count = atomic_load_explicit(&pool->cancelCount, memory_order_relaxed);
+	stats->expire_count = counterGet(&sum->expireCount) + counterGet(&pool->callerExpireCount);
+	stats->caller_run_count = counterGet(&pool->callerRunCount);
+	stats->park_count = counterGet(&sum->parkCount);
+	stats->busy_time = counterGet(&sum->busyNs) / 1e9;
+	stats->idle_time = counterGet(&sum->idleNs) / 1e9;
+	for (int i = 0; i < TPOOL_HIST_BUCKETS; ++i) {
+		stats->queue_wait_hist[i] = counterGet(&sum->waitHist[i]);
+		stats->exec_hist[i] = counterGet(&sum->execHist[i]);
+	}
+	free(sum);
+}
+
+int
+thread_pool_worker_stats(struct thread_pool *pool, struct thread_pool_worker_stats *stats,
+			 int count)
+{
+	int filled = 0;
+	pthread_mutex_lock(&pool->currentMutex);
+	uint64_t now = nowNs();
+	for (int i = 0; i < pool->maxThreads && filled < count; ++i) {
+		struct poolWorker *worker = &pool->workers[i];
+		if (worker->status != WALIVE) {
+			continue;
+		}
+		struct thread_pool_worker_stats *ws = &stats[filled++];
+		uint64_t busy = counterGet(&worker->stats.busyNs);
+		uint64_t alive = now - worker->startTime;
+		ws->completed = counterGet(&worker->stats.completed);
+		ws->park_count = counterGet(&worker->stats.parkCount);
+		ws->busy_time = busy / 1e9;
+		ws->idle_time = (alive > busy ? alive - busy : 0) / 1e9;
+	}
+	pthread_mutex_unlock(&pool->currentMutex);
+	return filled;
+}
+
+uint64_t
+thread_pool_hist_percentile(const uint64_t *hist, double percentile)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < TPOOL_HIST_BUCKETS; ++i) {
+		total += hist[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(total * percentile / 100);
+	if (rank >= total) {
+		rank = total - 1;
+	}
+	int bucket = 0;
+	for (uint64_t seen = hist[0]; seen <= rank; seen += hist[bucket]) {
+		++bucket;
+	}
+	if (bucket < 4) {
+		return bucket;
+	}
+	/* Upper bound of the bucket, the inverse of histBucket(). */
+	int shift = bucket / 4 - 1;
+	uint64_t low = (uint64_t)(4 + bucket % 4) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+int
+thread_pool_completion_fd(const struct thread_pool *pool)
+{
+	return pool->completion != NULL ? thread_completion_fd(pool->completion) : -1;
+}
+
+int
+thread_pool_drain_completions(struct thread_pool *pool, struct thread_task **tasks, int count)
+{
+	if (pool->completion == NULL || count <= 0) {
+		return 0;
+	}
+	return completionTake(pool->completion, tasks, count);
+}
+
+int
+thread_pool_delete(struct thread_pool *pool)
+{
+	if (pool->taskCount != 0) {
+		return TPOOL_ERR_HAS_TASKS;
+	}
+	if (pool->completion != NULL && atomic_load(&pool->completion->pendingCount) != 0) {
+		return TPOOL_ERR_HAS_TASKS;
+	}
+	pthread_mutex_lock(&pool->currentMutex);
+	pool->exit = true;
+	for (int i = 0; i < pool->queueCount; ++i) {
+		pthread_cond_broadcast(&pool->queues[i].cond);
+	}
+	/* No new threads after exit, so the slots can be read once. */
+	int threadCount = 0;
+	pthread_t *threads = malloc(pool->maxThreads * sizeof(pthread_t));
+	for (int i = 0; i < pool->maxThreads; ++i) {
+		if (pool->workers[i].status != WFREE) {
+			threads[threadCount++] = pool->workers[i].thread;
+		}
+	}
+	pthread_mutex_unlock(&pool->currentMutex);
+	for (int i = 0; i < threadCount; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	free(pool->workersMem);
+	for (int i = 0; i < pool->queueCount; ++i) {
+		pthread_cond_destroy(&pool->queues[i].cond);
+	}
+	pthread_cond_destroy(&pool->notFullCond);
+	if (pool->completion != NULL) {
+		thread_completion_delete(pool->completion);
+	}
+	free(pool->queues);
+	for (int i = 0; i < pool->cpuGroupCount; ++i) {
+		free(pool->cpuGroups[i].cpus);
+	}
+	free(pool->cpuGroups);
+	pthread_mutex_destroy(&pool->currentMutex);
+	free(pool);
+	return 0;
+}
+
+int
+thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+{
+	if (taskIsHeld(task)) {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	task->queueIndex = 0;
+	return poolPush(pool, task);
+}
+
+int
+thread_pool_push_task_wait(struct thread_pool *pool, struct thread_task *task)
+{
+	if (taskIsHeld(task)) {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	if (!poolTryReserve(pool)) {
+		poolReserveWait(pool, NULL);
+	}
+	task->queueIndex = 0;
+	poolPushReserved(pool, task);
+	return 0;
+}
+
+int
+thread_pool_push_task_timed(struct thread_pool *pool, struct thread_task *task, double timeout)
+{
+	if (taskIsHeld(task)) {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	if (!poolTryReserve(pool)) {
+		if (timeout <= 0) {
+			return TPOOL_ERR_TIMEOUT;
+		}
+		struct timespec deadline;
+		deadlineAfter(&deadline, timeout);
+		int rc = poolReserveWait(pool, &deadline);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+	task->queueIndex = 0;
+	poolPushReserved(pool, task);
+	return 0;
+}
+
+int
+thread_pool_node_count(const struct thread_pool *pool)
+{
+	return pool->queueCount - 1;
+}
+
+int
+thread_pool_push_task_node(struct thread_pool *pool, struct thread_task *task, int node)
+{
+	if (node < 0 || node >= pool->queueCount - 1) {
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	if (taskIsHeld(task)) {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	task->queueIndex = node + 1;
+	return poolPush(pool, task);
+}
+
+int
+thread_pool_push_task_prio(struct thread_pool *pool, struct thread_task *task, int priority)
+{
+	int rc = thread_task_set_priority(task, priority);
+	if (rc != 0) {
+		return rc;
+	}
+	return thread_pool_push_task(pool, task);
+}
+
+int
+thread_pool_queue_depth(const struct thread_pool *pool, int priority)
+{
+	if (priority < 0 || priority >= TPOOL_PRIO_COUNT) {
+		return 0;
+	}
+	int depth = 0;
+	for (int i = 0; i < pool->queueCount; ++i) {
+		depth += atomic_load_explicit((atomic_int *)&pool->queues[i].lanes[priority].depth,
+					      memory_order_relaxed);
+	}
+	return depth;
+}
+
+int
+thread_task_new(struct thread_task **task, thread_task_f function, void *arg)
+{
+	*task = calloc(1, sizeof(struct thread_task));
+	taskInit(*task, function, arg);
+	return 0;
+}
 
-struct thread_pool {
-	pthread_t *threads;
+bool
+thread_task_is_finished(const struct thread_task *task)
+{
+	return taskStatus(atomic_load((atomic_uint *)&task->state)) == TFINISHED;
+}
 
-	atomic_int createdThreadCount;
-	atomic_int runningThreadCount;
-	atomic_int taskCount;
-	int maxThreads;
-	struct thread_task *current; // head
-	struct thread_task *last; // tail
-	pthread_mutex_t currentMutex;
-	pthread_cond_t currentCond;
-	bool exit;
-};
+bool
+thread_task_is_running(const struct thread_task *task)
+{
+	return taskStatus(atomic_load((atomic_uint *)&task->state)) == TRUNNING;
+}
 
-static void *threadRunner(void *voidPool) {
-	struct thread_pool *pool = voidPool;
-	while (true) {
-		pthread_mutex_lock(&pool->currentMutex);
-		while (pool->current == NULL) {
-			if (pool->exit) {
-				pthread_mutex_unlock(&pool->currentMutex);
-				return NULL;
-			}
-			pthread_cond_wait(&pool->currentCond, &pool->currentMutex);
+int
+thread_task_join(struct thread_task *task, void **result)
+{
+	unsigned state = atomic_load(&task->state);
+	if (taskStatus(state) == TINIT) {
+		return TPOOL_ERR_TASK_NOT_PUSHED;
+	}
+	for (int i = 0; i < TASK_JOIN_SPIN && taskStatus(state) != TFINISHED; ++i) {
+		cpuRelax();
+		state = atomic_load(&task->state);
+	}
+	/*
+	 * Other tasks are run instead of sleeping. Not in a fiber, its
+	 * stack is small and it would hold its thread for long.
+	 */
+	struct thread_pool *pool = task->pool;
+	if (pool->joinHelps && (currentTask == NULL || currentTask->coro == NULL)) {
+		struct thread_task *tp;
+		while (taskStatus(state) != TFINISHED && (tp = poolTakeForeign(pool)) != NULL) {
+			taskRunHere(tp, true);
+			state = atomic_load(&task->state);
 		}
-		if (pool->current->status != TWAITING) {
-			pthread_mutex_unlock(&pool->currentMutex);
+	}
+	while (taskStatus(state) != TFINISHED) {
+		if ((state & TASK_HAS_WAITER) == 0 &&
+		    !atomic_compare_exchange_weak(&task->state, &state, state | TASK_HAS_WAITER)) {
 			continue;
 		}
-		struct thread_task *tp = pool->current;
-		if (pool->last != NULL && pool->current == pool->last) {
-			pool->last = pool->last->prev;
+		futexWait(&task->state, state | TASK_HAS_WAITER);
+		state = atomic_load(&task->state);
+	}
+	*result = task->result;
+	task->next = NULL;
+	task->prev = NULL;
+	atomic_store(&task->state, TINIT);
+	return (state & TASK_CANCELLED) != 0 ? TPOOL_ERR_TASK_CANCELLED : 0;
+}
+
+int
+thread_task_cancel(struct thread_task *task)
+{
+	unsigned state = atomic_load(&task->state);
+	do {
+		if (taskStatus(state) == TINIT) {
+			return TPOOL_ERR_TASK_NOT_PUSHED;
+		}
+		if (state & TASK_CANCELLED) {
+			return 0;
 		}
-		pool->current = pool->current->next;
-		++pool->runningThreadCount;
-		pthread_mutex_unlock(&pool->currentMutex);
-		pthread_mutex_lock(&tp->resultMutex);
-		tp->status = TRUNNING;
-		pthread_mutex_unlock(&tp->resultMutex);
-		tp->result = tp->function(tp->arg);
-		pthread_mutex_lock(&tp->resultMutex);
-		--pool->taskCount;
-		--pool->runningThreadCount;
-		if (tp->isDetached) {
-			tp->status = TINIT;
-			pthread_mutex_unlock(&tp->resultMutex);
-			thread_task_delete(tp);
-			continue;
+		if (taskStatus(state) != TWAITING) {
+			return TPOOL_ERR_TASK_STARTED;
 		}
-		tp->status = TFINISHED;
-		pthread_cond_signal(&tp->resultCond);
-		pthread_mutex_unlock(&tp->resultMutex);
+	} while (!atomic_compare_exchange_weak(&task->state, &state, state | TASK_CANCELLED));
+	/*
+	 * From now on whoever takes the task drops it. If it is still
+	 * in a queue, it is taken right here. Otherwise a thread has
+	 * just popped it, or it waits for dependencies and is dropped
+	 * when they are done.
+	 */
+	struct thread_pool *pool = task->pool;
+	atomic_fetch_add_explicit(&pool->cancelCount, 1, memory_order_relaxed);
+	pthread_mutex_lock(&pool->currentMutex);
+	bool isRemoved = queueRemove(pool, task);
+	pthread_mutex_unlock(&pool->currentMutex);
+	if (!isRemoved) {
+		return 0;
 	}
-	return NULL;
+	task->result = NULL;
+	poolRelease(pool);
+	/* TWAITING -> TRUNNING, then taskComplete() finishes it. */
+	atomic_fetch_add(&task->state, 1);
+	struct thread_task *next = taskComplete(task);
+	if (next != NULL) {
+		poolEnqueue(next->pool, next);
+	}
+	return 0;
 }
 
 int
-thread_pool_new(int max_thread_count, struct thread_pool **pool)
+thread_task_set_deadline(struct thread_task *task, double timeout)
 {
-	if (max_thread_count <= 0 || max_thread_count > TPOOL_MAX_THREADS) {
+	if (timeout < 0) {
 		return TPOOL_ERR_INVALID_ARGUMENT;
 	}
-	*pool = calloc(1, sizeof(struct thread_pool));
-	(*pool)->maxThreads = max_thread_count;
-	(*pool)->threads = calloc(max_thread_count, sizeof(pthread_t));
-	pthread_mutex_init(&(*pool)->currentMutex, NULL);
-	pthread_cond_init(&(*pool)->currentCond, NULL);
+	if (taskStatus(atomic_load(&task->state)) != TINIT) {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	task->timeout = timeout;
 	return 0;
 }
 
 int
-thread_pool_thread_count(const struct thread_pool *pool)
+thread_task_set_cost(struct thread_task *task, double cost)
 {
-	return pool->createdThreadCount;
+	if (cost < 0) {
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	if (taskStatus(atomic_load(&task->state)) != TINIT) {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	task->cost = cost;
+	return 0;
 }
 
 int
-thread_pool_delete(struct thread_pool *pool)
+thread_task_delete(struct thread_task *task)
 {
-	if (pool->taskCount != 0) {
+	if (taskStatus(atomic_load(&task->state)) != TINIT || taskIsHeld(task)) {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	free(task->successors);
+	free(task);
+	return 0;
+}
+
+int
+thread_task_detach(struct thread_task *task)
+{
+	unsigned state = atomic_load(&task->state);
+	if (taskIsHeld(task) && taskStatus(state) != TINIT) {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	while (true) {
+		if (taskStatus(state) == TINIT) {
+			return TPOOL_ERR_TASK_NOT_PUSHED;
+		}
+		if (taskStatus(state) == TFINISHED) {
+			atomic_store(&task->state, TINIT);
+			thread_task_delete(task);
+			return 0;
+		}
+		/* The worker will see the flag when it finishes the task. */
+		if (atomic_compare_exchange_weak(&task->state, &state, state | TASK_DETACHED)) {
+			return 0;
+		}
+	}
+}
+
+int
+thread_task_set_priority(struct thread_task *task, int priority)
+{
+	if (priority < 0 || priority >= TPOOL_PRIO_COUNT) {
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	if (taskStatus(atomic_load(&task->state)) != TINIT) {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	task->priority = priority;
+	return 0;
+}
+
+int
+thread_task_then(struct thread_task *task, struct thread_task *next)
+{
+	if (task == next) {
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	if (taskStatus(atomic_load(&task->state)) != TINIT ||
+	    taskStatus(atomic_load(&next->state)) != TINIT) {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	if (task->successorCount == task->successorCapacity) {
+		int capacity = task->successorCapacity == 0 ? 4 : task->successorCapacity * 2;
+		task->successors = realloc(task->successors, capacity * sizeof(*task->successors));
+		task->successorCapacity = capacity;
+	}
+	task->successors[task->successorCount++] = next;
+	atomic_fetch_add(&next->depCount, 1);
+	return 0;
+}
+
+int
+thread_task_group_new(struct thread_task_group **group)
+{
+	*group = calloc(1, sizeof(struct thread_task_group));
+	atomic_init(&(*group)->state, 0);
+	atomic_init(&(*group)->done, NULL);
+	pthread_mutex_init(&(*group)->readyMutex, NULL);
+	return 0;
+}
+
+int
+thread_task_group_delete(struct thread_task_group *group)
+{
+	if (atomic_load(&group->state) != 0) {
 		return TPOOL_ERR_HAS_TASKS;
 	}
-	pthread_mutex_lock(&pool->currentMutex);
-	pool->exit = true;
-	pool->current = NULL;
-	pool->last = NULL;
-	pthread_cond_broadcast(&pool->currentCond);
-	pthread_mutex_unlock(&pool->currentMutex);
-	ssize_t tCount = pool->createdThreadCount;
-	for (size_t i = 0; i < pool->createdThreadCount; ++i) {
-		pthread_join(pool->threads[i], NULL);
+	/* Finished tasks nobody asked for are released silently. */
+	pthread_mutex_lock(&group->readyMutex);
+	groupCollect(group);
+	for (struct thread_task *tp = group->ready; tp != NULL; tp = tp->groupNext) {
+		tp->group = NULL;
 	}
-	free(pool->threads);
-	pthread_cond_destroy(&pool->currentCond);
-	pthread_mutex_destroy(&pool->currentMutex);
-	free(pool);
+	pthread_mutex_unlock(&group->readyMutex);
+	pthread_mutex_destroy(&group->readyMutex);
+	free(group);
 	return 0;
 }
 
 int
-thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+thread_task_group_push(struct thread_task_group *group, struct thread_pool *pool,
+		       struct thread_task *task)
 {
-	if (pool->taskCount >= TPOOL_MAX_TASKS) {
-		return TPOOL_ERR_TOO_MANY_TASKS;
+	if (taskIsHeld(task)) {
+		return TPOOL_ERR_TASK_IN_POOL;
 	}
-	if (pool->createdThreadCount < pool->maxThreads && pool->createdThreadCount - pool->runningThreadCount == 0) {
-		if (pthread_create(&pool->threads[pool->createdThreadCount], NULL, threadRunner, pool) == 0) {
-			pool->createdThreadCount++;
-		}
+	task->group = group;
+	task->queueIndex = 0;
+	atomic_fetch_add(&group->state, GROUP_PENDING_ONE);
+	int rc = poolPush(pool, task);
+	if (rc != 0) {
+		atomic_fetch_sub(&group->state, GROUP_PENDING_ONE);
+		task->group = NULL;
 	}
-	pthread_mutex_lock(&pool->currentMutex);
-	pthread_mutex_lock(&task->resultMutex);
-	task->status = TWAITING;
-	struct thread_task *tp = pool->current;
-	if (tp != NULL) {
-		if (pool->last != NULL) {
-			pool->last->next = task;
-		}
-		task->prev = pool->last;
-		pool->last = task;
-	} else {
-		pool->current = task;
-		pool->last = task;
-		task->next = NULL;
-		task->prev = NULL;
+	return rc;
+}
+
+int
+thread_task_group_wait_all(struct thread_task_group *group)
+{
+	bool isWaiter = groupWaiterAdd(group);
+	unsigned state = atomic_load(&group->state);
+	while (state >= GROUP_PENDING_ONE) {
+		groupWait(group, state, isWaiter);
+		state = atomic_load(&group->state);
+	}
+	if (isWaiter) {
+		atomic_fetch_sub(&group->state, 1);
+	}
+	/* Everything is finished, give all the tasks back. */
+	pthread_mutex_lock(&group->readyMutex);
+	groupCollect(group);
+	struct thread_task *tp = group->ready;
+	group->ready = NULL;
+	group->readyLast = NULL;
+	pthread_mutex_unlock(&group->readyMutex);
+	while (tp != NULL) {
+		struct thread_task *next = tp->groupNext;
+		tp->groupNext = NULL;
+		tp->group = NULL;
+		tp = next;
 	}
-	pthread_cond_signal(&pool->currentCond);
-	pthread_mutex_unlock(&pool->currentMutex);
-	pthread_mutex_unlock(&task->resultMutex);
-	
-	++pool->taskCount;
 	return 0;
 }
 
 int
-thread_task_new(struct thread_task **task, thread_task_f function, void *arg)
+thread_task_group_wait_any(struct thread_task_group *group, struct thread_task **task)
 {
-	*task = calloc(1, sizeof(struct thread_task));
-	(*task)->function = function;
-	(*task)->arg = arg;
-	pthread_mutex_init(&(*task)->resultMutex, NULL);
-	pthread_cond_init(&(*task)->resultCond, NULL);
+	bool isWaiter = false;
+	bool isPolling = false;
+	int rc = 0;
+	while (true) {
+		/*
+		 * Pending is read before the finished list is taken, and
+		 * a worker publishes into the list before decrementing
+		 * pending. So zero pending plus an empty list means the
+		 * group is really empty.
+		 */
+		unsigned state = atomic_load(&group->state);
+		pthread_mutex_lock(&group->readyMutex);
+		groupCollect(group);
+		struct thread_task *tp = group->ready;
+		if (tp != NULL) {
+			group->ready = tp->groupNext;
+			if (group->ready == NULL) {
+				group->readyLast = NULL;
+			}
+		}
+		pthread_mutex_unlock(&group->readyMutex);
+		if (tp != NULL) {
+			tp->groupNext = NULL;
+			tp->group = NULL;
+			*task = tp;
+			break;
+		}
+		if (state < GROUP_PENDING_ONE) {
+			rc = TPOOL_ERR_NO_TASKS;
+			break;
+		}
+		if (!isWaiter && !isPolling) {
+			/* Register and re-check, the state is changed by that. */
+			isWaiter = groupWaiterAdd(group);
+			isPolling = !isWaiter;
+			continue;
+		}
+		groupWait(group, state, isWaiter);
+	}
+	if (isWaiter) {
+		atomic_fetch_sub(&group->state, 1);
+	}
+	return rc;
+}
+
+int
+thread_pool_parallel_for(struct thread_pool *pool, size_t begin, size_t end, size_t grain,
+			 thread_range_f function, void *ctx)
+{
+	if (function == NULL || begin > end) {
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	if (begin == end) {
+		return 0;
+	}
+	struct parallelJob job = {0};
+	job.ctx = ctx;
+	job.forFunction = function;
+	int helperCount = parallelPrepare(pool, &job, begin, end, grain);
+	struct thread_task *helpers = NULL;
+	if (helperCount > 0) {
+		helpers = calloc(helperCount, sizeof(struct thread_task));
+	}
+	parallelExecute(pool, &job, helpers, helperCount);
+	free(helpers);
 	return 0;
 }
 
-bool
-thread_task_is_finished(const struct thread_task *task)
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, size_t begin, size_t end, size_t grain,
+			    thread_reduce_f function, thread_combine_f combine, void *ctx,
+			    void *result, size_t result_size)
 {
-	return task->status == TFINISHED;
+	if (function == NULL || combine == NULL || result == NULL || result_size == 0 ||
+	    begin > end) {
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	if (begin == end) {
+		return 0;
+	}
+	struct parallelJob job = {0};
+	job.ctx = ctx;
+	job.reduceFunction = function;
+	job.identity = result;
+	job.resultSize = result_size;
+	int helperCount = parallelPrepare(pool, &job, begin, end, grain);
+	/* Helper tasks and accumulators of all participants in one block. */
+	size_t helpersSize = helperCount * sizeof(struct thread_task);
+	char *mem = calloc(1, helpersSize + (helperCount + 1) * result_size);
+	job.accs = mem + helpersSize;
+	parallelExecute(pool, &job, (struct thread_task *)mem, helperCount);
+	/* The result holds the identity, it is folded with everything. */
+	int accCount = atomic_load(&job.accCount);
+	for (int i = 0; i < accCount; ++i) {
+		combine(ctx, result, job.accs + i * result_size);
+	}
+	free(mem);
+	return 0;
 }
 
-bool
-thread_task_is_running(const struct thread_task *task)
+int
+thread_completion_new(struct thread_completion **completion)
 {
-	return task->status == TRUNNING;
+	*completion = calloc(1, sizeof(struct thread_completion));
+	atomic_init(&(*completion)->done, NULL);
+	atomic_init(&(*completion)->pendingCount, 0);
+	pthread_mutex_init(&(*completion)->readyMutex, NULL);
+	(*completion)->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return 0;
 }
 
 int
-thread_task_join(struct thread_task *task, void **result)
+thread_completion_delete(struct thread_completion *completion)
 {
-	pthread_mutex_lock(&task->resultMutex);
-	if (task->status == TINIT) {
-		pthread_mutex_unlock(&task->resultMutex);
-		return TPOOL_ERR_TASK_NOT_PUSHED;
+	if (atomic_load(&completion->pendingCount) != 0) {
+		return TPOOL_ERR_HAS_TASKS;
 	}
-	if (task->status != TFINISHED) {
-		pthread_cond_wait(&task->resultCond, &task->resultMutex);
-		*result = task->result;
-	} else {
-		*result = task->result;
+	close(completion->fd);
+	pthread_mutex_destroy(&completion->readyMutex);
+	free(completion);
+	return 0;
+}
+
+int
+thread_completion_fd(const struct thread_completion *completion)
+{
+	return completion->fd;
+}
+
+int
+thread_task_set_completion(struct thread_task *task, struct thread_completion *completion)
+{
+	if (taskStatus(atomic_load(&task->state)) != TINIT || taskIsHeld(task)) {
+		return TPOOL_ERR_TASK_IN_POOL;
 	}
-	task->status = TINIT;
-	task->next = NULL;
-	task->prev = NULL;
-	pthread_mutex_unlock(&task->resultMutex);
+	task->completionTarget = completion;
 	return 0;
 }
 
 int
-thread_task_delete(struct thread_task *task)
+thread_completion_pop(struct thread_completion *completion, struct thread_task **task)
+{
+	int taken;
+	return completionWait(completion, task, 1, NULL, &taken);
+}
+
+int
+thread_completion_timed_pop(struct thread_completion *completion, double timeout,
+			    struct thread_task **task)
+{
+	struct timespec deadline;
+	deadlineAfter(&deadline, timeout > 0 ? timeout : 0);
+	int taken;
+	return completionWait(completion, task, 1, &deadline, &taken);
+}
+
+int
+thread_completion_try_pop(struct thread_completion *completion, struct thread_task **task)
+{
+	return thread_completion_timed_pop(completion, 0, task);
+}
+
+int
+thread_completion_pop_batch(struct thread_completion *completion, struct thread_task **tasks,
+			    int count)
 {
-	pthread_mutex_lock(&task->resultMutex);
-	if (task->status != TINIT) {
-		pthread_mutex_unlock(&task->resultMutex);
+	if (count <= 0) {
+		return 0;
+	}
+	int taken;
+	completionWait(completion, tasks, count, NULL, &taken);
+	return taken;
+}
+
+int
+thread_task_set_fiber(struct thread_task *task, bool is_fiber)
+{
+	if (taskStatus(atomic_load(&task->state)) != TINIT) {
 		return TPOOL_ERR_TASK_IN_POOL;
 	}
-	pthread_cond_broadcast(&task->resultCond);
-	pthread_cond_destroy(&task->resultCond);
-	pthread_mutex_unlock(&task->resultMutex);
-	pthread_mutex_destroy(&task->resultMutex);
-	free(task);
+	task->isFiber = is_fiber;
 	return 0;
 }
 
+struct thread_task *
+thread_task_self(void)
+{
+	return currentTask;
+}
+
+void
+thread_task_yield(void)
+{
+	struct thread_task *tp = currentTask;
+	if (tp == NULL || tp->coro == NULL) {
+		sched_yield();
+		return;
+	}
+	tp->fiberIntent = FIBER_YIELD;
+	coro_suspend();
+	currentTask = tp;
+}
+
 int
-thread_task_detach(struct thread_task *task)
+thread_task_suspend(void)
 {
-	if (task->status == TINIT) {
-		return TPOOL_ERR_TASK_NOT_PUSHED;
+	struct thread_task *tp = currentTask;
+	if (tp == NULL) {
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	unsigned expected = WAKE_PENDING;
+	if (atomic_compare_exchange_strong(&tp->wakeState, &expected, WAKE_NONE)) {
+		return 0;
+	}
+	if (tp->coro != NULL) {
+		/* The thread marks the fiber suspended once it is switched out. */
+		tp->fiberIntent = FIBER_SUSPEND;
+		coro_suspend();
+		currentTask = tp;
+		return 0;
 	}
-	pthread_mutex_lock(&task->resultMutex);
-	if (task->status == TFINISHED) {
-		task->status = TINIT;
-		pthread_mutex_unlock(&task->resultMutex);
-		thread_task_delete(task);
+	/* Not a fiber - the thread itself sleeps. */
+	expected = WAKE_NONE;
+	if (!atomic_compare_exchange_strong(&tp->wakeState, &expected, WAKE_SUSPENDED)) {
+		atomic_store(&tp->wakeState, WAKE_NONE);
 		return 0;
 	}
-	task->isDetached = true;
-	pthread_mutex_unlock(&task->resultMutex);
+	while (atomic_load(&tp->wakeState) == WAKE_SUSPENDED) {
+		futexWait(&tp->wakeState, WAKE_SUSPENDED);
+	}
+	return 0;
+}
+
+int
+thread_task_resume(struct thread_task *task)
+{
+	/* A woken thread task can be freed at once, read it before. */
+	bool isFiber = task->isFiber;
+	unsigned state = atomic_load(&task->wakeState);
+	while (true) {
+		if (state == WAKE_PENDING) {
+			return 0;
+		}
+		if (state == WAKE_NONE) {
+			if (atomic_compare_exchange_weak(&task->wakeState, &state, WAKE_PENDING)) {
+				return 0;
+			}
+			continue;
+		}
+		if (atomic_compare_exchange_weak(&task->wakeState, &state, WAKE_NONE)) {
+			break;
+		}
+	}
+	if (isFiber) {
+		fiberSchedule(task);
+	} else {
+		futexWake(&task->wakeState);
+	}
+	return 0;
+}
+
+int
+thread_strand_new(struct thread_strand **strand, struct thread_pool *pool)
+{
+	struct thread_strand *st = calloc(1, sizeof(struct thread_strand));
+	st->pool = pool;
+	pthread_mutex_init(&st->mutex, NULL);
+	taskInit(&st->runner, strandRun, st);
+	st->runner.isRaw = true;
+	*strand = st;
+	return 0;
+}
+
+int
+thread_strand_delete(struct thread_strand *strand)
+{
+	pthread_mutex_lock(&strand->mutex);
+	bool isBusy = strand->isScheduled;
+	pthread_mutex_unlock(&strand->mutex);
+	if (isBusy) {
+		return TPOOL_ERR_HAS_TASKS;
+	}
+	pthread_mutex_destroy(&strand->mutex);
+	free(strand);
 	return 0;
-}
\ No newline at end of file
+}
+
+int
+thread_strand_push(struct thread_strand *strand, struct thread_task *task)
+{
+	if (taskIsHeld(task)) {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	/* A fiber or a dependency would let the task out of order. */
+	if (task->isFiber || atomic_load(&task->depCount) != 1) {
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	struct thread_pool *pool = strand->pool;
+	if (!poolTryReserve(pool)) {
+		return TPOOL_ERR_TOO_MANY_TASKS;
+	}
+	taskPrepare(pool, task);
+	task->queueTime = nowNs();
+	task->next = NULL;
+	pthread_mutex_lock(&strand->mutex);
+	if (strand->tail != NULL) {
+		strand->tail->next = task;
+	} else {
+		strand->head = task;
+	}
+	strand->tail = task;
+	bool needSchedule = !strand->isScheduled;
+	strand->isScheduled = true;
+	pthread_mutex_unlock(&strand->mutex);
+	if (needSchedule) {
+		poolEnqueue(pool, &strand->runner);
+	}
+	return 0;
+}
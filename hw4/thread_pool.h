@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #ifndef THREAD_POOL_DEFINED
 #define THREAD_POOL_DEFINED
 
@@ -8,12 +10,67 @@
 
 struct thread_pool;
 struct thread_task;
+struct thread_task_group;
+struct thread_completion;
+struct thread_strand;
 
 typedef void *(*thread_task_f)(void *);
+/** Body of a parallel loop, called for a sub-range [begin, end). */
+typedef void (*thread_range_f)(void *ctx, size_t begin, size_t end);
+/** Body of a parallel reduce, folds [begin, end) into @a acc. */
+typedef void (*thread_reduce_f)(void *ctx, size_t begin, size_t end, void *acc);
+/** Merge accumulator @a other into @a acc. */
+typedef void (*thread_combine_f)(void *ctx, void *acc, const void *other);
 
 enum {
+	/** Limit of thread_pool_new(). */
 	TPOOL_MAX_THREADS = 20,
+	/** Limit of max_thread_count in thread_pool_opts. */
+	TPOOL_OPTS_MAX_THREADS = 4096,
+	/** Default task limit. */
 	TPOOL_MAX_TASKS = 100000,
+	/** Default number of queue polls before an idle thread parks. */
+	TPOOL_SPIN_COUNT = 100,
+	/**
+	 * Buckets of a latency histogram. Nanoseconds below 4 have a
+	 * bucket each, then every power of two is split in 4. The last
+	 * bucket starts at 7 * 2^38 ns, about 32 minutes, and takes all
+	 * longer values too.
+	 */
+	TPOOL_HIST_BUCKETS = 160,
+};
+
+/** Default idle time in seconds after which a thread exits. */
+#define TPOOL_IDLE_TIMEOUT 1.0
+
+/**
+ * Priority lanes of a pool queue. Higher lanes are served first,
+ * with aging so as lower ones can't starve.
+ */
+enum thread_task_prio {
+	TPOOL_PRIO_HIGH = 0,
+	TPOOL_PRIO_NORMAL,
+	TPOOL_PRIO_LOW,
+	TPOOL_PRIO_COUNT,
+};
+
+/** How pool threads are placed on CPUs. */
+enum thread_pool_placement {
+	/** Threads float freely. */
+	TPOOL_PLACE_NONE = 0,
+	/** All threads are pinned to the user's CPU set. */
+	TPOOL_PLACE_CPUSET,
+	/**
+	 * Each thread is pinned to a physical core, taking them by
+	 * turns. Hyperthreads of one core count as one.
+	 */
+	TPOOL_PLACE_CORES,
+	/**
+	 * Threads are grouped by NUMA nodes and pinned to their node's
+	 * CPUs. Each node has its own queue, see
+	 * thread_pool_push_task_node().
+	 */
+	TPOOL_PLACE_NUMA,
 };
 
 enum thread_poool_errcode {
@@ -23,13 +80,93 @@ enum thread_poool_errcode {
 	TPOOL_ERR_TASK_NOT_PUSHED,
 	TPOOL_ERR_TASK_IN_POOL,
 	TPOOL_ERR_NOT_IMPLEMENTED,
+	TPOOL_ERR_NO_TASKS,
+	TPOOL_ERR_TIMEOUT,
+	TPOOL_ERR_TASK_CANCELLED,
+	TPOOL_ERR_TASK_STARTED,
+};
+
+/**
+ * Thread pool creation options. Fill the defaults with
+ * thread_pool_opts_create() and change what is needed.
+ */
+struct thread_pool_opts {
+	/** Maximum pool size, up to TPOOL_OPTS_MAX_THREADS. */
+	int max_thread_count;
+	/**
+	 * Maximum number of tasks pushed to the pool and not finished
+	 * yet, including running ones and ones waiting for
+	 * dependencies.
+	 */
+	int max_task_count;
+	/**
+	 * Seconds a thread waits for tasks before it exits and
+	 * releases its stack. 0 means threads never exit.
+	 */
+	double idle_timeout;
+	/**
+	 * How many times an idle thread polls the queue before it
+	 * goes to sleep. Spinning cuts the wakeup latency of bursty
+	 * loads at the cost of some CPU.
+	 */
+	int spin_count;
+	/** One of TPOOL_PLACE_*. */
+	int placement;
+	/** CPUs for TPOOL_PLACE_CPUSET. The array is copied. */
+	const int *cpus;
+	int cpu_count;
+	/**
+	 * Report finished tasks through thread_pool_drain_completions()
+	 * and an eventfd, see thread_pool_completion_fd().
+	 */
+	bool completion_queue;
+	/**
+	 * Run a task on the pushing thread instead of failing with
+	 * TPOOL_ERR_TOO_MANY_TASKS, or when all the threads are
+	 * started and at least as many tasks are queued already.
+	 */
+	bool caller_runs;
+	/**
+	 * Run a task on the pushing thread right in the push, if its
+	 * cost hint is below this many seconds, see
+	 * thread_task_set_cost(). 0 turns it off.
+	 */
+	double inline_cost;
+	/**
+	 * A thread sleeping in thread_task_join() runs queued tasks of
+	 * the pool until the joined one is finished.
+	 */
+	bool join_helps;
 };
 
 /** Thread pool API. */
 
+/**
+ * Fill @a opts with default values.
+ * @param opts Options to initialize.
+ */
+void
+thread_pool_opts_create(struct thread_pool_opts *opts);
+
+/**
+ * Create a new thread pool configured by @a opts. Threads are
+ * started lazily, when the queue is deeper than the number of
+ * idle threads, and exit after being idle for too long.
+ * @param opts Pool options.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - max_thread_count is too big
+ *       or 0, max_task_count is 0, negative timeout, spin count or
+ *       inline cost, bad placement or empty CPU set.
+ */
+int
+thread_pool_new_opts(const struct thread_pool_opts *opts, struct thread_pool **pool);
+
 /**
  * Create a new thread pool with maximum @a max_thread_count
- * threads.
+ * threads and default options.
  * @param max_thread_count Maximum pool size.
  * @param[out] Pointer to store result pool object.
  *
@@ -42,26 +179,55 @@ int
 thread_pool_new(int max_thread_count, struct thread_pool **pool);
 
 /**
- * How many threads are created by this pool. Can be less than
- * max.
+ * How many threads are alive in this pool. Can be less than max,
+ * idle threads exit after a timeout.
  * @param pool Thread pool to get thread count of.
  * @retval Thread count.
  */
 int
 thread_pool_thread_count(const struct thread_pool *pool);
 
+/**
+ * Eventfd of the pool completion queue, for epoll and the like. It
+ * becomes readable when tasks finish, and stays so until all of
+ * them are drained. It must not be read or closed by the user.
+ * @param pool Pool created with completion_queue option.
+ * @retval File descriptor, -1 if the pool has no completion queue.
+ */
+int
+thread_pool_completion_fd(const struct thread_pool *pool);
+
+/**
+ * Take up to @a count tasks finished since the last call, in the
+ * order they finished. Never blocks. In a pool with a completion
+ * queue each pushed task is held by the queue once it finishes,
+ * like by a group: it can not be deleted, detached or pushed again
+ * until it is drained. A task can be drained a moment before it is
+ * marked finished, so joining a drained task waits at most for
+ * that moment.
+ * @param pool Pool created with completion_queue option.
+ * @param[out] tasks Array to store finished tasks.
+ * @param count Array size.
+ * @retval Number of stored tasks.
+ */
+int
+thread_pool_drain_completions(struct thread_pool *pool, struct thread_task **tasks, int count);
+
 /**
  * Delete @a pool, free its memory.
  * @param pool Pool to delete.
  * @retval 0 Success.
  * @retval != Error code.
- *     - TPOOL_ERR_HAS_TASKS - pool still has tasks.
+ *     - TPOOL_ERR_HAS_TASKS - pool still has tasks, or finished
+ *       tasks which are not drained.
  */
 int
 thread_pool_delete(struct thread_pool *pool);
 
 /**
- * Push @a task into thread pool queue.
+ * Push @a task into thread pool queue. With caller_runs or
+ * inline_cost options the task can be run right here, and is
+ * finished when the push returns.
  * @param pool Pool to push into.
  * @param task Task to push.
  *
@@ -69,10 +235,221 @@ thread_pool_delete(struct thread_pool *pool);
  * @retval != Error code.
  *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
  *       already.
+ *     - TPOOL_ERR_TASK_IN_POOL - task still belongs to a group.
  */
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Push @a task into thread pool queue. If the pool has too many
+ * tasks, sleep until one of them finishes.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - task still belongs to a group.
+ */
+int
+thread_pool_push_task_wait(struct thread_pool *pool, struct thread_task *task);
+
+/**
+ * The same as thread_pool_push_task_wait(), but sleep not longer
+ * than @a timeout seconds.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ * @param timeout Seconds to wait for a free slot.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TIMEOUT - the pool was full until the timeout.
+ *     - TPOOL_ERR_TASK_IN_POOL - task still belongs to a group.
+ */
+int
+thread_pool_push_task_timed(struct thread_pool *pool, struct thread_task *task, double timeout);
+
+/**
+ * Push @a task into a lane of @a pool queue. The same as setting
+ * task priority and pushing it.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ * @param priority One of TPOOL_PRIO_*.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - bad priority.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ *     - TPOOL_ERR_TASK_IN_POOL - task is pushed already or
+ *       still belongs to a group.
+ */
+int
+thread_pool_push_task_prio(struct thread_pool *pool, struct thread_task *task, int priority);
+
+/**
+ * How many tasks wait in a lane of @a pool queue. Running tasks
+ * and tasks waiting for dependencies are not counted.
+ * @param pool Thread pool to get queue depth of.
+ * @param priority One of TPOOL_PRIO_*.
+ * @retval Queued task count.
+ */
+int
+thread_pool_queue_depth(const struct thread_pool *pool, int priority);
+
+/**
+ * How many NUMA nodes have their own queue in @a pool. It is 0
+ * unless the pool is created with TPOOL_PLACE_NUMA. Topology is
+ * read from /sys, nodes are numbered from 0 in the order of their
+ * system numbers, nodes without CPUs are skipped.
+ * @param pool Thread pool to get node count of.
+ * @retval Node count.
+ */
+int
+thread_pool_node_count(const struct thread_pool *pool);
+
+/**
+ * Push @a task into the queue of NUMA @a node, so as it runs on
+ * a thread of that node, close to its data. A node thread is
+ * started for it if needed. Threads of other nodes steal node
+ * tasks only when they have nothing else to do.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ * @param node Node index, less than thread_pool_node_count().
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no such node.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ *     - TPOOL_ERR_TASK_IN_POOL - task still belongs to a group.
+ */
+int
+thread_pool_push_task_node(struct thread_pool *pool, struct thread_task *task, int node);
+
+/**
+ * Call @a function for sub-ranges covering [begin, end), in
+ * parallel. The calling thread takes part in the work, pool
+ * threads help it. Chunks are claimed from a shared cursor, large
+ * ones first, shrinking down to @a grain towards the end, so no
+ * task is created per chunk. Returns when the whole range is
+ * done.
+ * @param pool Pool to take helper threads from.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Minimal chunk size, 0 to choose automatically.
+ * @param function Loop body.
+ * @param ctx Argument for @a function.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no function, or begin is
+ *       bigger than end.
+ */
+int
+thread_pool_parallel_for(struct thread_pool *pool, size_t begin, size_t end, size_t grain,
+			 thread_range_f function, void *ctx);
+
+/**
+ * Reduce [begin, end) in parallel, the same way as
+ * thread_pool_parallel_for() splits it. Each participant folds its
+ * chunks into its own accumulator started from a copy of
+ * @a result, then all the accumulators are merged into @a result.
+ * So @a result has to hold the identity value on input, and
+ * @a combine has to be associative and commutative.
+ * @param pool Pool to take helper threads from.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Minimal chunk size, 0 to choose automatically.
+ * @param function Folds a chunk into an accumulator.
+ * @param combine Merges two accumulators.
+ * @param ctx Argument for @a function and @a combine.
+ * @param[in][out] result Identity on input, result on output.
+ * @param result_size Size of @a result.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no function or result, or
+ *       begin is bigger than end.
+ */
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, size_t begin, size_t end, size_t grain,
+			    thread_reduce_f function, thread_combine_f combine, void *ctx,
+			    void *result, size_t result_size);
+
+/** Pool counters, summed over all the threads ever started. */
+struct thread_pool_stats {
+	/** Alive threads. */
+	int thread_count;
+	/** Pushed and not finished tasks. */
+	int task_count;
+	/** Tasks waiting in the queues. */
+	int queue_depth;
+	/** Tasks run by pool threads. */
+	uint64_t completed;
+	/** Tasks cancelled by thread_task_cancel(). */
+	uint64_t cancel_count;
+	/** Tasks dropped because their deadline passed. */
+	uint64_t expire_count;
+	/**
+	 * Tasks run by pushing or joining threads, see caller_runs,
+	 * inline_cost and join_helps options.
+	 */
+	uint64_t caller_run_count;
+	/** Threads started. */
+	uint64_t spawn_count;
+	/** Times idle threads went to sleep. */
+	uint64_t park_count;
+	/** Seconds spent in tasks and between them. */
+	double busy_time;
+	double idle_time;
+	/**
+	 * Nanoseconds from a task becoming runnable till its start,
+	 * and of its run. See thread_pool_hist_percentile().
+	 */
+	uint64_t queue_wait_hist[TPOOL_HIST_BUCKETS];
+	uint64_t exec_hist[TPOOL_HIST_BUCKETS];
+};
+
+/** Counters of one alive pool thread. */
+struct thread_pool_worker_stats {
+	uint64_t completed;
+	uint64_t park_count;
+	double busy_time;
+	double idle_time;
+};
+
+/**
+ * Collect @a pool counters. Threads keep them privately and are
+ * not stopped, so the numbers are a bit behind if tasks are
+ * running.
+ * @param pool Thread pool to get stats of.
+ * @param[out] stats Stats to fill.
+ */
+void
+thread_pool_stats(struct thread_pool *pool, struct thread_pool_stats *stats);
+
+/**
+ * Collect counters of each alive thread of @a pool.
+ * @param pool Thread pool to get stats of.
+ * @param[out] stats Array to fill.
+ * @param count Array size.
+ * @retval Number of filled entries.
+ */
+int
+thread_pool_worker_stats(struct thread_pool *pool, struct thread_pool_worker_stats *stats,
+			 int count);
+
+/**
+ * Value at @a percentile of a pool latency histogram. It is the
+ * upper bound of the bucket, so it overestimates by up to 25%.
+ * For the last bucket it is 2^41 - 1 ns, longer values included.
+ * @param hist Histogram of TPOOL_HIST_BUCKETS buckets.
+ * @param percentile From 0 to 100.
+ * @retval Nanoseconds, 0 for an empty histogram.
+ */
+uint64_t
+thread_pool_hist_percentile(const uint64_t *hist, double percentile);
+
 /** Thread pool task API. */
 
 /**
@@ -86,6 +463,20 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg);
 
+/**
+ * Set which lane of a pool queue @a task goes to. By default it
+ * is TPOOL_PRIO_NORMAL.
+ * @param task Task to set priority of.
+ * @param priority One of TPOOL_PRIO_*.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - bad priority.
+ *     - TPOOL_ERR_TASK_IN_POOL - task is pushed already.
+ */
+int
+thread_task_set_priority(struct thread_task *task, int priority);
+
 /**
  * Check if @a task is finished and its result can be obtained.
  * @param task Task to check.
@@ -110,10 +501,115 @@ thread_task_is_running(const struct thread_task *task);
  * @retval 0 Success.
  * @retval != 0 Error code.
  *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a pool.
+ *     - TPOOL_ERR_TASK_CANCELLED - task was cancelled or expired
+ *       and did not run, result is NULL. The task is joined
+ *       anyway.
  */
 int
 thread_task_join(struct thread_task *task, void **result);
 
+/**
+ * Make @a task a fiber. A fiber runs on its own coroutine stack,
+ * so it can give its thread away with thread_task_yield() or
+ * thread_task_suspend() and let it run other tasks meanwhile.
+ * Once started, a fiber is continued only by the same thread. Such
+ * a thread does not exit while it has suspended fibers.
+ * @param task Task to change.
+ * @param is_fiber Whether to run the task as a fiber.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - task is pushed already.
+ */
+int
+thread_task_set_fiber(struct thread_task *task, bool is_fiber);
+
+/**
+ * The task run by the calling pool thread.
+ * @retval Task, NULL outside of pool tasks.
+ */
+struct thread_task *
+thread_task_self(void);
+
+/**
+ * Let the thread run other tasks and fibers, and continue the
+ * calling fiber later. Outside of fibers it is sched_yield().
+ */
+void
+thread_task_yield(void);
+
+/**
+ * Sleep until thread_task_resume() of the calling task. A fiber
+ * gives its thread away meanwhile, other tasks block the thread.
+ * If the resume came already, returns at once.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - not called from a pool task.
+ */
+int
+thread_task_suspend(void);
+
+/**
+ * Wake @a task sleeping in thread_task_suspend(). If it does not
+ * sleep yet, its next suspend returns at once. Can be called from
+ * any thread.
+ * @param task Task to wake.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_resume(struct thread_task *task);
+
+/**
+ * Cancel a pushed task which has not started yet. A queued task is
+ * unlinked from the queue at once, a task waiting for dependencies
+ * is dropped when they finish. A cancelled task is finished without
+ * running: it still has to be joined, which returns
+ * TPOOL_ERR_TASK_CANCELLED, its group is notified, and its
+ * successors are released as usual.
+ * @param task Task to cancel.
+ *
+ * @retval 0 Success, or the task is already cancelled.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a pool.
+ *     - TPOOL_ERR_TASK_STARTED - task is running or finished.
+ */
+int
+thread_task_cancel(struct thread_task *task);
+
+/**
+ * Make @a task stale @a timeout seconds after each push. A thread
+ * which takes a stale task drops it as if it was cancelled. It is
+ * for tasks whose result is useless after some time, so as an
+ * overloaded pool does not waste time on them.
+ * @param task Task to set deadline of.
+ * @param timeout Seconds, 0 for no deadline.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - negative timeout.
+ *     - TPOOL_ERR_TASK_IN_POOL - task is pushed already.
+ */
+int
+thread_task_set_deadline(struct thread_task *task, double timeout);
+
+/**
+ * Hint how long @a task runs. A pool with the inline_cost option
+ * runs tasks cheaper than that on the pushing thread, saving the
+ * queueing and wakeup which would cost more than the task itself.
+ * Fibers and tasks waiting for dependencies are always queued.
+ * @param task Task to set cost of.
+ * @param cost Seconds, 0 for unknown.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - negative cost.
+ *     - TPOOL_ERR_TASK_IN_POOL - task is pushed already.
+ */
+int
+thread_task_set_cost(struct thread_task *task, double cost);
+
 /**
  * Delete a task, free its memory.
  * @param task Task to delete.
@@ -121,7 +617,7 @@ thread_task_join(struct thread_task *task, void **result);
  * @retval 0 Success.
  * @retval != Error code.
  *     - TPOOL_ERR_TASK_IN_POOL - can not drop the task. It still
- *       is in a pool. Need to join it firstly.
+ *       is in a pool or in a group. Need to join it firstly.
  */
 int
 thread_task_delete(struct thread_task *task);
@@ -135,8 +631,264 @@ thread_task_delete(struct thread_task *task);
  * @retval != Error code.
  *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a
  *       pool.
+ *     - TPOOL_ERR_TASK_IN_POOL - task belongs to a group or is
+ *       reported by a completion queue, it is returned by them
+ *       instead.
 */
 int
 thread_task_detach(struct thread_task *task);
 
+/**
+ * Make @a next depend on @a task. A pushed task is queued only
+ * when all its dependencies are finished, and it is usually run
+ * by the thread which finished the last one. A task can have many
+ * dependencies and many dependants. The edge is used once: after
+ * @a task is finished, it has to be added again for a next push.
+ * Neither task can be deleted while the edge is not used.
+ * @param task Task to finish first.
+ * @param next Task to run after @a task.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a task can not depend on
+ *       itself.
+ *     - TPOOL_ERR_TASK_IN_POOL - one of the tasks is pushed
+ *       already.
+ */
+int
+thread_task_then(struct thread_task *task, struct thread_task *next);
+
+/** Task group API. */
+
+/**
+ * Create a new task group. A group counts tasks pushed through it
+ * and lets to wait for all of them or for the first finished one
+ * with a single wakeup instead of joining them one by one.
+ * @param[out] group Pointer to store result group object.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_group_new(struct thread_task_group **group);
+
+/**
+ * Delete @a group, free its memory. Finished tasks which were not
+ * returned by a wait are released from the group.
+ * @param group Group to delete.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_HAS_TASKS - group still has not finished tasks,
+ *       or somebody waits on it.
+ */
+int
+thread_task_group_delete(struct thread_task_group *group);
+
+/**
+ * Push @a task into @a pool as a member of @a group. The task
+ * stays in the group until a wait returns it. Until then it can
+ * not be deleted, detached or pushed again, but it still can be
+ * joined.
+ * @param group Group to add the task to.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ *     - TPOOL_ERR_TASK_IN_POOL - task already belongs to a group.
+ */
+int
+thread_task_group_push(struct thread_task_group *group, struct thread_pool *pool,
+		       struct thread_task *task);
+
+/**
+ * Wait until all the tasks of @a group are finished, and release
+ * them from the group. Joining them afterwards does not block.
+ * @param group Group to wait for.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_group_wait_all(struct thread_task_group *group);
+
+/**
+ * Wait until any task of @a group is finished and return it.
+ * Tasks are returned in the order they finished, each one only
+ * once, and are released from the group.
+ * @param group Group to wait for.
+ * @param[out] task Pointer to store the finished task.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_NO_TASKS - group has neither pending nor not
+ *       returned finished tasks.
+ */
+int
+thread_task_group_wait_any(struct thread_task_group *group, struct thread_task **task);
+
+/**
+ * Completion queue API. Tasks bound to a queue are returned by it
+ * in the order they finished, no matter in which order they were
+ * pushed, so a slow task does not hold the consumer back. A queue
+ * can collect tasks of any pools.
+ */
+
+/**
+ * Create a new completion queue.
+ * @param[out] completion Pointer to store result queue.
+ *
+ * @retval Always 0.
+ */
+int
+thread_completion_new(struct thread_completion **completion);
+
+/**
+ * Delete @a completion, free its memory.
+ * @param completion Queue to delete.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_HAS_TASKS - some pushed tasks are not popped
+ *       yet.
+ */
+int
+thread_completion_delete(struct thread_completion *completion);
+
+/**
+ * Eventfd which is readable while @a completion has finished tasks,
+ * for epoll and the like. It must not be read or closed by the
+ * user.
+ * @param completion Queue to get fd of.
+ * @retval File descriptor.
+ */
+int
+thread_completion_fd(const struct thread_completion *completion);
+
+/**
+ * Bind @a task to @a completion. Each next push of the task puts
+ * it into the queue once it is finished, instead of the pool
+ * completion queue if there is one. Until it is popped, the task
+ * can not be deleted, detached or pushed again. A task can be
+ * popped a moment before it is marked finished, so joining a
+ * popped task waits at most for that moment.
+ * @param task Task to bind.
+ * @param completion Queue to bind to, NULL to unbind.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - task is pushed already or is not
+ *       popped yet.
+ */
+int
+thread_task_set_completion(struct thread_task *task, struct thread_completion *completion);
+
+/**
+ * Wait until any bound task is finished and return it.
+ * @param completion Queue to pop from.
+ * @param[out] task Pointer to store the finished task.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_NO_TASKS - no pushed tasks which are not popped
+ *       yet.
+ */
+int
+thread_completion_pop(struct thread_completion *completion, struct thread_task **task);
+
+/**
+ * The same as thread_completion_pop(), but wait not longer than
+ * @a timeout seconds.
+ * @param completion Queue to pop from.
+ * @param timeout Seconds to wait.
+ * @param[out] task Pointer to store the finished task.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_NO_TASKS - no pushed tasks which are not popped
+ *       yet.
+ *     - TPOOL_ERR_TIMEOUT - no task finished in time.
+ */
+int
+thread_completion_timed_pop(struct thread_completion *completion, double timeout,
+			    struct thread_task **task);
+
+/**
+ * Pop a finished task if there is one, never wait.
+ * @param completion Queue to pop from.
+ * @param[out] task Pointer to store the finished task.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_NO_TASKS - no pushed tasks which are not popped
+ *       yet.
+ *     - TPOOL_ERR_TIMEOUT - none of them is finished.
+ */
+int
+thread_completion_try_pop(struct thread_completion *completion, struct thread_task **task);
+
+/**
+ * Wait until any bound task is finished, then pop up to @a count
+ * finished tasks at once.
+ * @param completion Queue to pop from.
+ * @param[out] tasks Array to store the finished tasks.
+ * @param count Array size.
+ *
+ * @retval Number of popped tasks, 0 if there are no pushed tasks
+ *         which are not popped yet.
+ */
+int
+thread_completion_pop_batch(struct thread_completion *completion, struct thread_task **tasks,
+			    int count);
+
+/**
+ * Strand API. A strand runs its tasks one by one in push order on
+ * threads of a pool, while different strands run in parallel. For
+ * example, all the work on one key can be pushed to the strand of
+ * its shard instead of taking a per-key lock. A strand does not
+ * occupy a thread while it waits for tasks.
+ */
+
+/**
+ * Create a new strand on top of @a pool.
+ * @param[out] strand Pointer to store result strand.
+ * @param pool Pool to run the tasks in.
+ *
+ * @retval Always 0.
+ */
+int
+thread_strand_new(struct thread_strand **strand, struct thread_pool *pool);
+
+/**
+ * Delete @a strand, free its memory. The pool must outlive it.
+ * It succeeds as soon as all the pushed tasks are joined.
+ * @param strand Strand to delete.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_HAS_TASKS - strand still has not finished tasks.
+ */
+int
+thread_strand_delete(struct thread_strand *strand);
+
+/**
+ * Push @a task into @a strand. It starts only after all the tasks
+ * pushed into the strand before it are finished, and it is joined,
+ * detached and cancelled like any other pushed task. The task
+ * priority is ignored.
+ * @param strand Strand to push into.
+ * @param task Task to push.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ *     - TPOOL_ERR_TASK_IN_POOL - task already belongs to a group.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - task is a fiber or depends on
+ *       other tasks, so it could finish out of order.
+ */
+int
+thread_strand_push(struct thread_strand *strand, struct thread_task *task);
+
 #endif /* THREAD_POOL_DEFINED */
\ No newline at end of file
@@ -1,13 +1,31 @@
 #define _GNU_SOURCE
 #include "heap_help.h"
 
-#include <assert.h>
 #include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Only a hint that the slab region is not backed by swap.
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
 
 static void *(*default_malloc)(size_t) = NULL;
 static void (*default_free)() = NULL;
@@ -15,46 +33,889 @@ static void *(*default_calloc)(size_t, size_t) = NULL;
 static void *(*default_realloc)(void *, size_t) = NULL;
 static char *(*default_strdup)(const char *) = NULL;
 static ssize_t (*default_getline)(char **, size_t *, FILE *) = NULL;
+static void *(*default_aligned_alloc)(size_t, size_t) = NULL;
+static int (*default_posix_memalign)(void **, size_t, size_t) = NULL;
+#ifndef __APPLE__
+static size_t (*default_malloc_usable_size)(void *) = NULL;
+#endif
+
+static size_t block_usable_size(void *ptr);
+
+// Thread-local storage of an interposer must not allocate on the first
+// access, which the dynamic TLS models may do.
+#define HEAPH_TLS __thread __attribute__((tls_model("initial-exec")))
+
+enum {
+	HEAPH_SHARD_COUNT = 64,
+	HEAPH_CACHE_LINE = 64,
+	// How much a shard lets its live bytes change before it adds them to
+	// the global number. The peak can be off by that much per shard.
+	HEAPH_FLUSH_BYTES = 64 * 1024,
+	// Frames kept of a sampled stack.
+	HEAPH_SAMPLE_DEPTH = 16,
+	// Frames of heap_help itself on top of a captured stack.
+	HEAPH_SAMPLE_SKIP = 2,
+	HEAPH_STACK_COUNT = 4096,
+	HEAPH_LIVE_COUNT = 65536,
+	HEAPH_FILTER_COUNT = 16384,
+	// Slots looked at before a table is considered full.
+	HEAPH_PROBE_MAX = 64,
+	HEAPH_SAMPLE_TOP = 10,
+	// Sizes up to this are served by slabs in HHALLOC mode. There are 8
+	// classes by 16 bytes up to 128, then 4 classes per power of 2.
+	HEAPH_SLAB_MAX = 2048,
+	HEAPH_SLAB_CLASSES = 24,
+	HEAPH_SLAB_SIZE = 64 * 1024,
+	// Address space reserved for slabs. When it is over, the default
+	// allocator is used.
+	HEAPH_SLAB_COUNT = 65536,
+	// Blocks a thread moves to or from the shared lists at once, and the
+	// most it keeps for itself.
+	HEAPH_SLAB_BATCH = 64,
+	HEAPH_SLAB_CACHE_MAX = 4 * HEAPH_SLAB_BATCH,
+	// Call durations by powers of 2 of ticks.
+	HEAPH_TIME_BUCKETS = 40,
+	// Slow calls reported right when they happen, the rest are counted.
+	HEAPH_TIME_SLOW_PRINT = 10,
+	// Records a thread collects before it writes them out.
+	HEAPH_TRACE_BUF_RECORDS = 4096,
+	// Thread numbers take 16 bits of a record. Threads past that many
+	// alive at once share the last number.
+	HEAPH_TRACE_THREAD_MAX = 65535,
+};
+
+// A piece of the allocation counter. Threads are spread over the shards
+// round-robin, so in a pool of threads each one has own cache line and
+// they do not fight over it. The total is only known as a sum of all
+// the shards. A block allocated in one thread and freed in another makes
+// their shards go up and down, only the sum makes sense.
+struct heaph_shard {
+	int64_t alloc_count;
+	// Allocations and their asked bytes ever made, frees do not undo it.
+	uint64_t alloc_total;
+	uint64_t alloc_total_bytes;
+	// The rest is used only by the profiler.
+	int64_t live_delta;
+	uint64_t alloc_bytes;
+	uint64_t op_count[HEAPH_OP_COUNT];
+	uint64_t op_bytes[HEAPH_OP_COUNT];
+	uint64_t size_hist[HEAPH_SIZE_CLASSES];
+	// Timing of the allocator calls, in ticks.
+	uint64_t time_count[HEAPH_OP_COUNT];
+	uint64_t time_sum[HEAPH_OP_COUNT];
+	uint64_t time_max[HEAPH_OP_COUNT];
+	uint64_t time_slow[HEAPH_OP_COUNT];
+	uint64_t time_hist[HEAPH_OP_COUNT][HEAPH_TIME_BUCKETS];
+} __attribute__((aligned(HEAPH_CACHE_LINE)));
+
+static struct heaph_shard shards[HEAPH_SHARD_COUNT];
+static unsigned next_shard = 0;
+static HEAPH_TLS struct heaph_shard *local_shard = NULL;
+// Set while a hook calls the default functions, which can call other
+// hooked functions inside. Like strdup() calls malloc(). Then only the
+// outer one counts the allocation.
+static HEAPH_TLS int hook_depth = 0;
+
+enum {
+	HEAPH_INIT_NONE,
+	HEAPH_INIT_RUNNING,
+	HEAPH_INIT_DONE,
+};
+
+static int init_state = HEAPH_INIT_NONE;
+static bool is_report = false;
+static bool is_profile = false;
+// Live bytes flushed from the shards, and the peak of that.
+static int64_t live_bytes = 0;
+static int64_t peak_bytes = 0;
+
+// A call stack seen by the sampler. Slots are taken once by a CAS of the
+// hash and never freed, the frames are valid after is_ready is set.
+struct heaph_stack {
+	uint64_t hash;
+	int is_ready;
+	int depth;
+	void *frames[HEAPH_SAMPLE_DEPTH];
+	uint64_t sample_count;
+	uint64_t sample_bytes;
+	int64_t live_count;
+	int64_t live_bytes;
+};
+
+// A sampled block which is not freed yet.
+struct heaph_live {
+	uintptr_t ptr;
+	uint32_t stack;
+	uint64_t bytes;
+};
+
+enum {
+	HEAPH_LIVE_EMPTY = 0,
+	HEAPH_LIVE_DELETED = 1,
+};
+
+// Mean bytes between samples, 0 when the sampler is off.
+static int64_t sample_interval = 0;
+static struct heaph_stack stacks[HEAPH_STACK_COUNT];
+// Open addressing by the block address, lock-free: a slot is taken and
+// released by a CAS of ptr.
+static struct heaph_live lives[HEAPH_LIVE_COUNT];
+// Sampled live blocks by a hash of their address. Each free() checks it,
+// and only if it is not 0 looks into the big table above.
+static uint16_t live_filter[HEAPH_FILTER_COUNT];
+static HEAPH_TLS int64_t sample_left = 0;
+static HEAPH_TLS uint64_t sample_rand = 0;
+
+// Free blocks of a size class owned by one thread. The first word of a
+// free block links it to the next one.
+struct heaph_slab_cache {
+	void *head;
+	int count;
+};
+
+// Free blocks given back by threads, in chains of up to HEAPH_SLAB_BATCH.
+// The second word of the first block of a chain links it to the next
+// chain.
+struct heaph_slab_list {
+	bool lock;
+	void *chains;
+} __attribute__((aligned(HEAPH_CACHE_LINE)));
+
+static bool is_time = false;
+static double ticks_per_ns = 1;
+static uint64_t time_slow_ticks = 0;
+static int time_slow_printed = 0;
+
+// Trace records of one thread. The lock is taken by the owner on each
+// record and by whoever flushes all the buffers at exit, so it is never
+// contended in between. When the thread exits, the buffer is flushed and
+// goes to the free list, and a new thread takes it with its number.
+struct heaph_trace_buf {
+	bool lock;
+	uint16_t thread;
+	int count;
+	struct heaph_trace_buf *next;
+	struct heaph_trace_buf *next_free;
+	struct heaph_trace_record records[HEAPH_TRACE_BUF_RECORDS];
+};
+
+static int trace_fd = -1;
+static uint64_t trace_start = 0;
+static unsigned trace_thread_count = 0;
+static struct heaph_trace_buf *trace_bufs = NULL;
+static struct heaph_trace_buf *trace_free_bufs = NULL;
+static bool trace_free_lock = false;
+static HEAPH_TLS struct heaph_trace_buf *trace_buf = NULL;
+
+static bool is_slab = false;
+static char *slab_region = NULL;
+static unsigned next_slab = 0;
+// Size class of each taken slab.
+static uint8_t slab_classes[HEAPH_SLAB_COUNT];
+static struct heaph_slab_list slab_lists[HEAPH_SLAB_CLASSES];
+static HEAPH_TLS struct heaph_slab_cache slab_caches[HEAPH_SLAB_CLASSES];
+// Thread caches are given back when their threads exit, by a destructor of
+// this key. Weak, so as pthread is not needed: without it there are no
+// threads to exit.
+#pragma weak pthread_key_create
+#pragma weak pthread_setspecific
+static pthread_key_t slab_key;
+static bool is_slab_key = false;
+static HEAPH_TLS bool is_slab_cache_used = false;
+// The same for trace buffers.
+static pthread_key_t trace_key;
+static bool is_trace_key = false;
 
-static int64_t alloc_count = 0;
-static bool global_lock = false;
+static inline struct heaph_shard *
+heaph_shard(void)
+{
+	struct heaph_shard *shard = local_shard;
+	if (shard != NULL)
+		return shard;
+	unsigned idx = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED);
+	shard = &shards[idx % HEAPH_SHARD_COUNT];
+	local_shard = shard;
+	return shard;
+}
 
 static inline void
 alloc_count_inc()
 {
-	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&heaph_shard()->alloc_count, 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+alloc_total_add(size_t size)
+{
+	struct heaph_shard *shard = heaph_shard();
+	__atomic_add_fetch(&shard->alloc_total, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&shard->alloc_total_bytes, size, __ATOMIC_RELAXED);
 }
 
 static inline void
 alloc_count_sub()
 {
-	int64_t old = __atomic_sub_fetch(&alloc_count, 1, __ATOMIC_SEQ_CST);
-	if (old >= 0)
+	// Shards go negative when blocks are freed by not their allocating
+	// threads, so a double free is seen only in the total, when it is
+	// read.
+	__atomic_sub_fetch(&heaph_shard()->alloc_count, 1, __ATOMIC_RELAXED);
+}
+
+static int64_t
+alloc_count_total(void)
+{
+	int64_t total = 0;
+	for (int i = 0; i < HEAPH_SHARD_COUNT; ++i)
+		total += __atomic_load_n(&shards[i].alloc_count, __ATOMIC_RELAXED);
+	return total;
+}
+
+static inline int
+size_class(size_t size)
+{
+	return size == 0 ? 0 : 64 - __builtin_clzll(size);
+}
+
+static void
+profile_peak_update(int64_t live)
+{
+	// Written only on a new peak, so usually it is a read of a shared
+	// cache line.
+	int64_t peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+	while (live > peak &&
+	       !__atomic_compare_exchange_n(&peak_bytes, &peak, live, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+// Account a call which changed the heap by @a bytes. @a size is what the
+// user asked for, @a bytes is what the allocator really gave or took.
+static void
+profile_add(int op, size_t size, int64_t bytes)
+{
+	struct heaph_shard *shard = heaph_shard();
+	__atomic_add_fetch(&shard->op_count[op], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&shard->op_bytes[op], bytes < 0 ? -bytes : bytes,
+			   __ATOMIC_RELAXED);
+	if (op != HEAPH_OP_FREE) {
+		__atomic_add_fetch(&shard->size_hist[size_class(size)], 1,
+				   __ATOMIC_RELAXED);
+	}
+	if (bytes > 0)
+		__atomic_add_fetch(&shard->alloc_bytes, bytes, __ATOMIC_RELAXED);
+	int64_t delta = __atomic_add_fetch(&shard->live_delta, bytes,
+					   __ATOMIC_RELAXED);
+	if (delta >= HEAPH_FLUSH_BYTES || delta <= -HEAPH_FLUSH_BYTES) {
+		delta = __atomic_exchange_n(&shard->live_delta, 0,
+					    __ATOMIC_RELAXED);
+		__atomic_add_fetch(&live_bytes, delta, __ATOMIC_RELAXED);
+		delta = 0;
+	}
+	// Other shards' unflushed bytes are not seen here.
+	if (bytes > 0)
+		profile_peak_update(__atomic_load_n(&live_bytes,
+						    __ATOMIC_RELAXED) + delta);
+}
+
+static inline uint64_t
+hash_ptr(uintptr_t ptr)
+{
+	return (ptr >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+// Next gap between samples, uniform in [interval / 2, interval * 3 / 2),
+// so as the samples do not lock onto a periodic allocation pattern.
+static int64_t
+sample_gap(void)
+{
+	uint64_t x = sample_rand;
+	if (x == 0)
+		x = (uintptr_t)&x | 1;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	sample_rand = x;
+	int64_t gap = sample_interval / 2 +
+		      (int64_t)(x % (uint64_t)sample_interval);
+	// With the interval 1 every byte is sampled, the gap can't be 0.
+	return gap > 0 ? gap : 1;
+}
+
+static struct heaph_stack *
+stack_find(void **frames, int depth)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < depth; ++i)
+		hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211ULL;
+	if (hash == 0)
+		hash = 1;
+	for (int i = 0; i < HEAPH_PROBE_MAX; ++i) {
+		struct heaph_stack *stack =
+			&stacks[(hash + i) % HEAPH_STACK_COUNT];
+		uint64_t old = __atomic_load_n(&stack->hash, __ATOMIC_ACQUIRE);
+		if (old == 0 &&
+		    __atomic_compare_exchange_n(&stack->hash, &old, hash, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			memcpy(stack->frames, frames, depth * sizeof(void *));
+			stack->depth = depth;
+			__atomic_store_n(&stack->is_ready, 1, __ATOMIC_RELEASE);
+			return stack;
+		}
+		if (old != hash)
+			continue;
+		while (__atomic_load_n(&stack->is_ready, __ATOMIC_ACQUIRE) == 0)
+			;
+		return stack;
+	}
+	return NULL;
+}
+
+static bool
+live_insert(uintptr_t ptr, uint32_t stack, uint64_t bytes)
+{
+	uint64_t hash = hash_ptr(ptr);
+	for (int i = 0; i < HEAPH_PROBE_MAX; ++i) {
+		struct heaph_live *live = &lives[(hash + i) % HEAPH_LIVE_COUNT];
+		uintptr_t old = __atomic_load_n(&live->ptr, __ATOMIC_RELAXED);
+		if (old > HEAPH_LIVE_DELETED)
+			continue;
+		if (!__atomic_compare_exchange_n(&live->ptr, &old, ptr, false,
+						 __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED))
+			continue;
+		// Only the owner of the block reads it back, after it is freed.
+		live->stack = stack;
+		live->bytes = bytes;
+		__atomic_add_fetch(&live_filter[hash % HEAPH_FILTER_COUNT], 1,
+				   __ATOMIC_RELEASE);
+		return true;
+	}
+	return false;
+}
+
+static bool
+live_remove(uintptr_t ptr, uint32_t *stack, uint64_t *bytes)
+{
+	uint64_t hash = hash_ptr(ptr);
+	uint16_t *filter = &live_filter[hash % HEAPH_FILTER_COUNT];
+	if (__atomic_load_n(filter, __ATOMIC_ACQUIRE) == 0)
+		return false;
+	for (int i = 0; i < HEAPH_PROBE_MAX; ++i) {
+		struct heaph_live *live = &lives[(hash + i) % HEAPH_LIVE_COUNT];
+		uintptr_t old = __atomic_load_n(&live->ptr, __ATOMIC_RELAXED);
+		if (old == HEAPH_LIVE_EMPTY)
+			return false;
+		if (old != ptr)
+			continue;
+		*stack = live->stack;
+		*bytes = live->bytes;
+		__atomic_store_n(&live->ptr, HEAPH_LIVE_DELETED,
+				 __ATOMIC_RELEASE);
+		__atomic_sub_fetch(filter, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+	return false;
+}
+
+// Capture the stack of an allocation which used up the sample gap. It has
+// to be a separate frame for the skip of heap_help frames to be right.
+static __attribute__((noinline)) void
+sample_take(void *ptr)
+{
+	// The gaps are the interval on average. The sample stands for one
+	// interval per gap the allocation crossed, so a block much bigger
+	// than the interval is counted as its size. What the allocation
+	// went past the last gap is taken from the next one. Whole
+	// intervals are skipped at once, not gap by gap.
+	int64_t skip = (-sample_left - 1) / sample_interval;
+	int64_t bytes = skip * sample_interval;
+	sample_left += bytes;
+	do {
+		bytes += sample_interval;
+		sample_left += sample_gap();
+	} while (sample_left < 0);
+	void *frames[HEAPH_SAMPLE_DEPTH + HEAPH_SAMPLE_SKIP];
+	// The first backtrace() loads libgcc and allocates, that is not
+	// counted.
+	++hook_depth;
+	int depth = backtrace(frames, HEAPH_SAMPLE_DEPTH + HEAPH_SAMPLE_SKIP);
+	--hook_depth;
+	if (depth <= HEAPH_SAMPLE_SKIP)
+		return;
+	struct heaph_stack *stack = stack_find(frames + HEAPH_SAMPLE_SKIP,
+					       depth - HEAPH_SAMPLE_SKIP);
+	if (stack == NULL)
+		return;
+	__atomic_add_fetch(&stack->sample_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stack->sample_bytes, bytes, __ATOMIC_RELAXED);
+	if (!live_insert((uintptr_t)ptr, stack - stacks, bytes))
+		return;
+	__atomic_add_fetch(&stack->live_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stack->live_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static inline __attribute__((always_inline)) void
+heaph_on_alloc(int op, size_t size, void *ptr)
+{
+	if (hook_depth > 0)
+		return;
+	alloc_count_inc();
+	alloc_total_add(size);
+	if (is_profile)
+		profile_add(op, size, block_usable_size(ptr));
+	if (sample_interval > 0) {
+		sample_left -= size + 1;
+		if (sample_left < 0)
+			sample_take(ptr);
+	}
+}
+
+static inline void
+heaph_on_free(void *ptr)
+{
+	// The blocks freed here were not counted either, see
+	// heaph_on_alloc().
+	if (hook_depth > 0)
+		return;
+	alloc_count_sub();
+	if (is_profile)
+		profile_add(HEAPH_OP_FREE, 0, -(int64_t)block_usable_size(ptr));
+	uint32_t stack;
+	uint64_t bytes;
+	if (sample_interval > 0 &&
+	    live_remove((uintptr_t)ptr, &stack, &bytes)) {
+		__atomic_sub_fetch(&stacks[stack].live_count, 1,
+				   __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&stacks[stack].live_bytes, bytes,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+// A block changed its size in place or moved, like in realloc().
+static inline void
+heaph_on_resize(int op, size_t size, size_t old_bytes, void *ptr)
+{
+	if (hook_depth > 0)
+		return;
+	alloc_total_add(size);
+	if (!is_profile)
+		return;
+	profile_add(op, size, (int64_t)block_usable_size(ptr) -
+		    (int64_t)old_bytes);
+}
+
+static inline size_t
+heaph_usable_size(void *ptr)
+{
+	return ptr != NULL && is_profile ? block_usable_size(ptr) : 0;
+}
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+static inline uint64_t
+time_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t
+time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Find the tick rate by a 10ms busy wait.
+static void
+time_calibrate(void)
+{
+	uint64_t ns = time_ns();
+	uint64_t ticks = time_ticks();
+	uint64_t elapsed;
+	while ((elapsed = time_ns() - ns) < 10000000)
+		cpu_relax();
+	ticks_per_ns = (double)(time_ticks() - ticks) / elapsed;
+}
+
+static inline uint64_t
+time_start(void)
+{
+	return is_time ? time_ticks() : 0;
+}
+
+static void
+time_slow_print(int op, uint64_t ticks)
+{
+	static const char *op_names[HEAPH_OP_COUNT] = {
+		"malloc", "calloc", "realloc", "strdup", "getline",
+		"aligned", "free",
+	};
+	if (__atomic_fetch_add(&time_slow_printed, 1, __ATOMIC_RELAXED) >=
+	    HEAPH_TIME_SLOW_PRINT)
+		return;
+	// No printf(), it could allocate right inside the allocator.
+	char buf[128];
+	int len = snprintf(buf, sizeof(buf), "heap_help: slow %s, %llu ns\n",
+			   op_names[op],
+			   (unsigned long long)(ticks / ticks_per_ns));
+	if (write(STDERR_FILENO, buf, len) < 0)
+		return;
+}
+
+static inline void
+time_end(int op, uint64_t start)
+{
+	if (!is_time)
+		return;
+	uint64_t ticks = time_ticks() - start;
+	struct heaph_shard *shard = heaph_shard();
+	int bucket = ticks == 0 ? 0 : 64 - __builtin_clzll(ticks);
+	if (bucket >= HEAPH_TIME_BUCKETS)
+		bucket = HEAPH_TIME_BUCKETS - 1;
+	__atomic_add_fetch(&shard->time_count[op], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&shard->time_sum[op], ticks, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&shard->time_hist[op][bucket], 1, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&shard->time_max[op], __ATOMIC_RELAXED);
+	while (ticks > max &&
+	       !__atomic_compare_exchange_n(&shard->time_max[op], &max, ticks,
+					    true, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+	if (ticks >= time_slow_ticks) {
+		__atomic_add_fetch(&shard->time_slow[op], 1, __ATOMIC_RELAXED);
+		time_slow_print(op, ticks);
+	}
+}
+
+static void
+trace_flush(struct heaph_trace_buf *buf)
+{
+	const char *pos = (const char *)buf->records;
+	size_t size = buf->count * sizeof(buf->records[0]);
+	buf->count = 0;
+	while (size > 0) {
+		ssize_t rc = write(trace_fd, pos, size);
+		if (rc <= 0)
+			return;
+		pos += rc;
+		size -= rc;
+	}
+}
+
+// A buffer of an exited thread, or NULL.
+static struct heaph_trace_buf *
+trace_buf_take(void)
+{
+	if (__atomic_load_n(&trace_free_bufs, __ATOMIC_RELAXED) == NULL)
+		return NULL;
+	while (__atomic_test_and_set(&trace_free_lock, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	struct heaph_trace_buf *buf = trace_free_bufs;
+	if (buf != NULL)
+		__atomic_store_n(&trace_free_bufs, buf->next_free,
+				 __ATOMIC_RELAXED);
+	__atomic_clear(&trace_free_lock, __ATOMIC_RELEASE);
+	return buf;
+}
+
+static void
+trace_thread_max_print(void)
+{
+	// No printf(), it could allocate right inside the allocator.
+	static const char msg[] = "heap_help: too many threads alive in the "
+				  "trace, the rest share the last number\n";
+	if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0)
+		return;
+}
+
+// Not from malloc(), it is called right inside it.
+static struct heaph_trace_buf *
+trace_buf_map(void)
+{
+	struct heaph_trace_buf *buf = mmap(NULL, sizeof(*buf),
+					   PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+	unsigned thread = __atomic_fetch_add(&trace_thread_count, 1,
+					     __ATOMIC_RELAXED);
+	if (thread == HEAPH_TRACE_THREAD_MAX)
+		trace_thread_max_print();
+	buf->thread = thread < HEAPH_TRACE_THREAD_MAX ?
+		      thread : HEAPH_TRACE_THREAD_MAX;
+	buf->next = __atomic_load_n(&trace_bufs, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_bufs, &buf->next, buf,
+					    true, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+	return buf;
+}
+
+static struct heaph_trace_buf *
+trace_buf_new(void)
+{
+	struct heaph_trace_buf *buf = trace_buf_take();
+	if (buf == NULL && (buf = trace_buf_map()) == NULL)
+		return NULL;
+	trace_buf = buf;
+	// After trace_buf is set, setspecific() can allocate and record.
+	if (is_trace_key)
+		pthread_setspecific(trace_key, buf);
+	return buf;
+}
+
+// Flush the buffer of an exiting thread and give it to the next new one.
+static void
+trace_buf_release(void *arg)
+{
+	struct heaph_trace_buf *buf = arg;
+	while (__atomic_test_and_set(&buf->lock, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	trace_flush(buf);
+	__atomic_clear(&buf->lock, __ATOMIC_RELEASE);
+	// Other destructors can allocate after, then a buffer is taken again.
+	trace_buf = NULL;
+	while (__atomic_test_and_set(&trace_free_lock, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	buf->next_free = trace_free_bufs;
+	__atomic_store_n(&trace_free_bufs, buf, __ATOMIC_RELAXED);
+	__atomic_clear(&trace_free_lock, __ATOMIC_RELEASE);
+}
+
+static void
+trace_record(int op, const void *ptr, const void *old_ptr, size_t size)
+{
+	if (trace_fd < 0)
 		return;
-	printf("Double-free detected\n");
-	exit(1);
+	struct heaph_trace_buf *buf = trace_buf;
+	if (buf == NULL && (buf = trace_buf_new()) == NULL)
+		return;
+	while (__atomic_test_and_set(&buf->lock, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	struct heaph_trace_record *rec = &buf->records[buf->count];
+	rec->time = time_ns() - trace_start;
+	rec->ptr = (uintptr_t)ptr;
+	rec->old_ptr = (uintptr_t)old_ptr;
+	rec->info = (uint64_t)op | (uint64_t)buf->thread << 8 |
+		    (uint64_t)size << 24;
+	if (++buf->count == HEAPH_TRACE_BUF_RECORDS)
+		trace_flush(buf);
+	__atomic_clear(&buf->lock, __ATOMIC_RELEASE);
 }
 
 static void
-heaph_lock(void)
+trace_flush_all(void)
 {
-	// It has to be a spinlock. So as not to depend on pthread.
-	while (true) {
-		int i = 0;
-		while (i++ < 1000) {
-			if (!__atomic_test_and_set(&global_lock,
-						   __ATOMIC_SEQ_CST))
-				return;
+	struct heaph_trace_buf *buf = __atomic_load_n(&trace_bufs,
+						      __ATOMIC_ACQUIRE);
+	for (; buf != NULL; buf = buf->next) {
+		while (__atomic_test_and_set(&buf->lock, __ATOMIC_ACQUIRE))
+			cpu_relax();
+		trace_flush(buf);
+		__atomic_clear(&buf->lock, __ATOMIC_RELEASE);
+	}
+}
+
+static inline int
+slab_class(size_t size)
+{
+	if (size <= 128)
+		return size == 0 ? 0 : (int)((size - 1) / 16);
+	int exp = 63 - __builtin_clzll(size - 1);
+	return 8 + (exp - 7) * 4 + (int)(((size - 1) >> (exp - 2)) & 3);
+}
+
+static inline size_t
+slab_class_size(int cls)
+{
+	if (cls < 8)
+		return (cls + 1) * 16;
+	int exp = (cls - 8) / 4 + 7;
+	return ((size_t)1 << exp) + ((cls - 8) % 4 + 1) * ((size_t)1 << (exp - 2));
+}
+
+static inline bool
+slab_owns(const void *ptr)
+{
+	return (const char *)ptr >= slab_region &&
+	       (const char *)ptr < slab_region +
+				   (size_t)HEAPH_SLAB_COUNT * HEAPH_SLAB_SIZE;
+}
+
+static inline size_t
+slab_block_size(const void *ptr)
+{
+	size_t slab = ((const char *)ptr - slab_region) / HEAPH_SLAB_SIZE;
+	return slab_class_size(slab_classes[slab]);
+}
+
+static void
+slab_list_lock(struct heaph_slab_list *list)
+{
+	while (__atomic_test_and_set(&list->lock, __ATOMIC_ACQUIRE))
+		cpu_relax();
+}
+
+static void
+slab_list_unlock(struct heaph_slab_list *list)
+{
+	__atomic_clear(&list->lock, __ATOMIC_RELEASE);
+}
+
+// Make the thread give its cache back when it exits.
+static inline void
+slab_cache_use(void)
+{
+	if (is_slab_cache_used || !is_slab_key)
+		return;
+	// First, setspecific() can allocate and get here again.
+	is_slab_cache_used = true;
+	pthread_setspecific(slab_key, slab_caches);
+}
+
+// Fill an empty thread cache: a chain from the shared list, or a new slab
+// cut into blocks. Returns false when the slab space is over.
+static bool
+slab_refill(int cls)
+{
+	slab_cache_use();
+	struct heaph_slab_cache *cache = &slab_caches[cls];
+	struct heaph_slab_list *list = &slab_lists[cls];
+	if (__atomic_load_n(&list->chains, __ATOMIC_RELAXED) != NULL) {
+		slab_list_lock(list);
+		void **chain = list->chains;
+		if (chain != NULL)
+			list->chains = chain[1];
+		slab_list_unlock(list);
+		if (chain != NULL) {
+			// Chains of exited threads can be shorter.
+			int count = 0;
+			for (void **block = chain; block != NULL; block = *block)
+				++count;
+			cache->head = chain;
+			cache->count = count;
+			return true;
 		}
-		usleep(10);
 	}
+	unsigned slab = __atomic_fetch_add(&next_slab, 1, __ATOMIC_RELAXED);
+	if (slab >= HEAPH_SLAB_COUNT)
+		return false;
+	char *base = slab_region + (size_t)slab * HEAPH_SLAB_SIZE;
+	if (mprotect(base, HEAPH_SLAB_SIZE, PROT_READ | PROT_WRITE) != 0)
+		return false;
+	slab_classes[slab] = cls;
+	size_t block_size = slab_class_size(cls);
+	int count = HEAPH_SLAB_SIZE / block_size;
+	for (int i = 0; i < count - 1; ++i)
+		*(void **)(base + i * block_size) = base + (i + 1) * block_size;
+	*(void **)(base + (count - 1) * block_size) = cache->head;
+	cache->head = base;
+	cache->count += count;
+	return true;
+}
+
+static void *
+slab_alloc(size_t size)
+{
+	int cls = slab_class(size);
+	struct heaph_slab_cache *cache = &slab_caches[cls];
+	if (cache->head == NULL && !slab_refill(cls))
+		return NULL;
+	void **block = cache->head;
+	cache->head = *block;
+	--cache->count;
+	return block;
+}
+
+static void
+slab_list_push(struct heaph_slab_list *list, void **chain)
+{
+	slab_list_lock(list);
+	chain[1] = list->chains;
+	list->chains = chain;
+	slab_list_unlock(list);
+}
+
+static void
+slab_free(void *ptr)
+{
+	size_t slab = ((char *)ptr - slab_region) / HEAPH_SLAB_SIZE;
+	int cls = slab_classes[slab];
+	struct heaph_slab_cache *cache = &slab_caches[cls];
+	slab_cache_use();
+	*(void **)ptr = cache->head;
+	cache->head = ptr;
+	if (++cache->count < HEAPH_SLAB_CACHE_MAX)
+		return;
+	// Too many, a batch goes to the shared list for other threads.
+	void **chain = cache->head;
+	void **last = chain;
+	for (int i = 1; i < HEAPH_SLAB_BATCH; ++i)
+		last = *last;
+	cache->head = *last;
+	cache->count -= HEAPH_SLAB_BATCH;
+	*last = NULL;
+	slab_list_push(&slab_lists[cls], chain);
 }
 
+// Give all the cached blocks of an exiting thread to the shared lists.
 static void
-heaph_unlock(void)
+slab_cache_release(void *arg)
+{
+	(void)arg;
+	for (int cls = 0; cls < HEAPH_SLAB_CLASSES; ++cls) {
+		struct heaph_slab_cache *cache = &slab_caches[cls];
+		while (cache->head != NULL) {
+			void **chain = cache->head;
+			void **last = chain;
+			for (int i = 1; i < HEAPH_SLAB_BATCH && *last != NULL; ++i)
+				last = *last;
+			cache->head = *last;
+			*last = NULL;
+			slab_list_push(&slab_lists[cls], chain);
+		}
+		cache->count = 0;
+	}
+	// Other destructors can allocate after, then it is called again.
+	is_slab_cache_used = false;
+}
+
+// Allocation in the current mode: small blocks from slabs if they are on
+// and not over, everything else from the default allocator.
+static inline void *
+block_alloc(size_t size)
 {
-	assert(global_lock);
-	__atomic_clear(&global_lock, __ATOMIC_SEQ_CST);
+	if (is_slab && size <= HEAPH_SLAB_MAX) {
+		void *res = slab_alloc(size);
+		if (res != NULL)
+			return res;
+	}
+	return default_malloc(size);
+}
+
+static inline void
+block_free(void *ptr)
+{
+	if (is_slab && slab_owns(ptr))
+		slab_free(ptr);
+	else
+		default_free(ptr);
 }
 
 static void
@@ -65,7 +926,24 @@ heaph_atexit(void)
 	static bool is_done = false;
 	if (__atomic_test_and_set(&is_done, __ATOMIC_SEQ_CST))
 		return;
-	int64_t count = __atomic_load_n(&alloc_count, __ATOMIC_SEQ_CST);
+	if (is_profile)
+		heaph_print_profile();
+	if (sample_interval > 0)
+		heaph_print_samples();
+	if (is_time)
+		heaph_print_times();
+	if (trace_fd >= 0)
+		trace_flush_all();
+	// Other threads are done or nearly so, the total is exact only now.
+	int64_t count = alloc_count_total();
+	if (count < 0) {
+		printf("Double-free detected\n");
+		fflush(stdout);
+		// exit() is not allowed in an atexit handler.
+		_exit(1);
+	}
+	if (!is_report)
+		return;
 	if (count != 0)
 		printf("Found %lld leaks\n", (long long)count);
 }
@@ -79,24 +957,96 @@ heaph_init(void)
 	default_calloc = dlsym(RTLD_NEXT, "calloc");
 	default_realloc = dlsym(RTLD_NEXT, "realloc");
 	default_free = dlsym(RTLD_NEXT, "free");
+	default_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+	default_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+#ifndef __APPLE__
+	default_malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+#endif
 
 	const char *hh_report = getenv("HHREPORT");
-	if (hh_report != NULL && strcmp(hh_report, "1") == 0)
-		atexit(heaph_atexit);
+	is_report = hh_report != NULL && strcmp(hh_report, "1") == 0;
+	const char *hh_profile = getenv("HHPROFILE");
+	is_profile = hh_profile != NULL && strcmp(hh_profile, "1") == 0;
+	const char *hh_sample = getenv("HHSAMPLE");
+	if (hh_sample != NULL)
+		sample_interval = strtoll(hh_sample, NULL, 10);
+	if (sample_interval < 0)
+		sample_interval = 0;
+	const char *hh_alloc = getenv("HHALLOC");
+	if (hh_alloc != NULL && strcmp(hh_alloc, "1") == 0) {
+		// Only reserved, slabs are made accessible one by one.
+		void *region = mmap(NULL,
+				    (size_t)HEAPH_SLAB_COUNT * HEAPH_SLAB_SIZE,
+				    PROT_NONE,
+				    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				    -1, 0);
+		if (region != MAP_FAILED) {
+			slab_region = region;
+			is_slab = true;
+			is_slab_key = pthread_key_create != NULL &&
+				      pthread_key_create(&slab_key,
+							 slab_cache_release) == 0;
+		}
+	}
+	const char *hh_time = getenv("HHTIME");
+	if (hh_time != NULL && strcmp(hh_time, "1") == 0) {
+		time_calibrate();
+		const char *hh_time_slow = getenv("HHTIME_SLOW");
+		uint64_t slow_ns = hh_time_slow != NULL ?
+				   strtoull(hh_time_slow, NULL, 10) : 100000;
+		time_slow_ticks = slow_ns * ticks_per_ns;
+		is_time = true;
+	}
+	const char *hh_trace = getenv("HHTRACE");
+	if (hh_trace != NULL && *hh_trace != 0) {
+		int fd = open(hh_trace, O_WRONLY | O_CREAT | O_TRUNC |
+				       O_APPEND | O_CLOEXEC, 0644);
+		struct heaph_trace_header header = {
+			.magic = HEAPH_TRACE_MAGIC,
+			.record_size = sizeof(struct heaph_trace_record),
+		};
+		if (fd >= 0 && write(fd, &header, sizeof(header)) ==
+			       sizeof(header)) {
+			is_trace_key = pthread_key_create != NULL &&
+				       pthread_key_create(&trace_key,
+							  trace_buf_release) == 0;
+			trace_start = time_ns();
+			trace_fd = fd;
+		} else if (fd >= 0) {
+			close(fd);
+		}
+	}
+	// Always, a double free is found there.
+	atexit(heaph_atexit);
 }
 
 static void
-heaph_touch(void)
+heaph_touch_slow(void)
 {
-	static bool is_done = false;
-	if (__atomic_load_n(&is_done, __ATOMIC_SEQ_CST))
+	// One thread does the init, the others wait for it. Not long, it is
+	// only a few dlsym() calls, so they spin and never sleep. It has to
+	// be so as not to depend on pthread.
+	int state = HEAPH_INIT_NONE;
+	if (__atomic_compare_exchange_n(&init_state, &state,
+					HEAPH_INIT_RUNNING, false,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		heaph_init();
+		__atomic_store_n(&init_state, HEAPH_INIT_DONE,
+				 __ATOMIC_RELEASE);
 		return;
+	}
+	while (__atomic_load_n(&init_state, __ATOMIC_ACQUIRE) !=
+	       HEAPH_INIT_DONE)
+		cpu_relax();
+}
 
-	heaph_lock();
-	heaph_init();
-	bool old = __atomic_exchange_n(&is_done, true, __ATOMIC_SEQ_CST);
-	heaph_unlock();
-	assert(!old);
+static inline void
+heaph_touch(void)
+{
+	if (__builtin_expect(__atomic_load_n(&init_state, __ATOMIC_ACQUIRE) ==
+			     HEAPH_INIT_DONE, true))
+		return;
+	heaph_touch_slow();
 }
 
 ssize_t
@@ -104,9 +1054,14 @@ getline(char **linep, size_t *linecapp, FILE *stream)
 {
 	heaph_touch();
 	char *line_old = *linep;
+	size_t old_bytes = heaph_usable_size(line_old);
+	++hook_depth;
 	ssize_t res = default_getline(linep, linecapp, stream);
+	--hook_depth;
 	if (line_old == NULL && *linep != NULL)
-		alloc_count_inc();
+		heaph_on_alloc(HEAPH_OP_GETLINE, *linecapp, *linep);
+	else if (heaph_usable_size(*linep) != old_bytes)
+		heaph_on_resize(HEAPH_OP_GETLINE, *linecapp, old_bytes, *linep);
 	return res;
 }
 
@@ -114,9 +1069,11 @@ char *
 strdup(const char *ptr)
 {
 	heaph_touch();
+	++hook_depth;
 	char *res = default_strdup(ptr);
+	--hook_depth;
 	if (res != NULL)
-		alloc_count_inc();
+		heaph_on_alloc(HEAPH_OP_STRDUP, strlen(res) + 1, res);
 	return res;
 }
 
@@ -124,9 +1081,13 @@ void *
 malloc(size_t size)
 {
 	heaph_touch();
-	void *res = default_malloc(size);
+	uint64_t start = time_start();
+	void *res = block_alloc(size);
+	time_end(HEAPH_OP_MALLOC, start);
+	if (res != NULL)
+		trace_record(HEAPH_OP_MALLOC, res, NULL, size);
 	if (res != NULL)
-		alloc_count_inc();
+		heaph_on_alloc(HEAPH_OP_MALLOC, size, res);
 	return res;
 }
 
@@ -134,9 +1095,19 @@ void *
 calloc(size_t num, size_t size)
 {
 	heaph_touch();
-	void *res = default_calloc(num, size);
+	uint64_t start = time_start();
+	void *res;
+	size_t total;
+	if (is_slab && !__builtin_mul_overflow(num, size, &total) &&
+	    total <= HEAPH_SLAB_MAX && (res = slab_alloc(total)) != NULL)
+		memset(res, 0, total);
+	else
+		res = default_calloc(num, size);
+	time_end(HEAPH_OP_CALLOC, start);
 	if (res != NULL)
-		alloc_count_inc();
+		trace_record(HEAPH_OP_CALLOC, res, NULL, num * size);
+	if (res != NULL)
+		heaph_on_alloc(HEAPH_OP_CALLOC, num * size, res);
 	return res;
 }
 
@@ -144,9 +1115,44 @@ void *
 realloc(void *ptr, size_t size)
 {
 	heaph_touch();
-	void *res = default_realloc(ptr, size);
-	if (ptr == NULL && res != NULL)
-		alloc_count_inc();
+	size_t old_bytes = heaph_usable_size(ptr);
+	// A sampled block keeps its stack when it moves.
+	uint32_t stack;
+	uint64_t bytes;
+	bool is_sampled = sample_interval > 0 && ptr != NULL &&
+			  live_remove((uintptr_t)ptr, &stack, &bytes);
+	uint64_t start = time_start();
+	void *res;
+	if (is_slab && (ptr == NULL || slab_owns(ptr))) {
+		// Slab blocks do not grow in place, they move. They stay if
+		// they shrink by less than half.
+		size_t old_size = ptr != NULL ? slab_block_size(ptr) : 0;
+		if (ptr != NULL && size <= old_size && size > old_size / 2)
+			res = ptr;
+		else if ((res = block_alloc(size == 0 ? 1 : size)) != NULL &&
+			 ptr != NULL) {
+			memcpy(res, ptr, old_size < size ? old_size : size);
+			slab_free(ptr);
+		}
+	} else {
+		res = default_realloc(ptr, size);
+	}
+	time_end(HEAPH_OP_REALLOC, start);
+	if (res != NULL || size == 0)
+		trace_record(HEAPH_OP_REALLOC, res, ptr, size);
+	if (is_sampled &&
+	    !live_insert((uintptr_t)(res != NULL ? res : ptr), stack, bytes)) {
+		__atomic_sub_fetch(&stacks[stack].live_count, 1,
+				   __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&stacks[stack].live_bytes, bytes,
+				   __ATOMIC_RELAXED);
+	}
+	if (res == NULL)
+		return res;
+	if (ptr == NULL)
+		heaph_on_alloc(HEAPH_OP_REALLOC, size, res);
+	else
+		heaph_on_resize(HEAPH_OP_REALLOC, size, old_bytes, res);
 	return res;
 }
 
@@ -156,12 +1162,300 @@ free(void *ptr)
 	if (ptr == NULL)
 		return;
 	heaph_touch();
-	alloc_count_sub();
-	default_free(ptr);
+	heaph_on_free(ptr);
+	// Before the block is freed, so as its next owner is after it.
+	trace_record(HEAPH_OP_FREE, ptr, NULL, 0);
+	uint64_t start = time_start();
+	block_free(ptr);
+	time_end(HEAPH_OP_FREE, start);
 }
 
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	heaph_touch();
+	++hook_depth;
+	uint64_t start = time_start();
+	void *res = default_aligned_alloc(alignment, size);
+	time_end(HEAPH_OP_ALIGNED, start);
+	if (res != NULL)
+		trace_record(HEAPH_OP_ALIGNED, res, (void *)alignment, size);
+	--hook_depth;
+	if (res != NULL)
+		heaph_on_alloc(HEAPH_OP_ALIGNED, size, res);
+	return res;
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	heaph_touch();
+	++hook_depth;
+	uint64_t start = time_start();
+	int rc = default_posix_memalign(memptr, alignment, size);
+	time_end(HEAPH_OP_ALIGNED, start);
+	if (rc == 0)
+		trace_record(HEAPH_OP_ALIGNED, *memptr, (void *)alignment, size);
+	--hook_depth;
+	if (rc == 0)
+		heaph_on_alloc(HEAPH_OP_ALIGNED, size, *memptr);
+	return rc;
+}
+
+// Real size of a block, by malloc_usable_size() or by its Mac twin.
+static size_t
+block_usable_size(void *ptr)
+{
+	if (is_slab && slab_owns(ptr))
+		return slab_block_size(ptr);
+#ifdef __APPLE__
+	return malloc_size(ptr);
+#else
+	return default_malloc_usable_size(ptr);
+#endif
+}
+
+#ifndef __APPLE__
+size_t
+malloc_usable_size(void *ptr)
+{
+	if (ptr == NULL)
+		return 0;
+	heaph_touch();
+	return block_usable_size(ptr);
+}
+#endif
+
 uint64_t
 heaph_get_alloc_count(void)
 {
-	return (uint64_t)__atomic_load_n(&alloc_count, __ATOMIC_SEQ_CST);
+	// Shards are read one by one while other threads run, so a block
+	// allocated in a read shard and freed in a not yet read one makes
+	// the sum short.
+	int64_t count = alloc_count_total();
+	return count > 0 ? (uint64_t)count : 0;
+}
+
+uint64_t
+heaph_get_alloc_total(void)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < HEAPH_SHARD_COUNT; ++i)
+		total += __atomic_load_n(&shards[i].alloc_total, __ATOMIC_RELAXED);
+	return total;
+}
+
+uint64_t
+heaph_get_alloc_total_bytes(void)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < HEAPH_SHARD_COUNT; ++i) {
+		total += __atomic_load_n(&shards[i].alloc_total_bytes,
+					 __ATOMIC_RELAXED);
+	}
+	return total;
+}
+
+bool
+heaph_get_profile(struct heaph_profile *profile)
+{
+	memset(profile, 0, sizeof(*profile));
+	if (!is_profile)
+		return false;
+	int64_t live = __atomic_load_n(&live_bytes, __ATOMIC_RELAXED);
+	for (int i = 0; i < HEAPH_SHARD_COUNT; ++i) {
+		struct heaph_shard *shard = &shards[i];
+		live += __atomic_load_n(&shard->live_delta, __ATOMIC_RELAXED);
+		profile->alloc_bytes += __atomic_load_n(&shard->alloc_bytes,
+							__ATOMIC_RELAXED);
+		for (int op = 0; op < HEAPH_OP_COUNT; ++op) {
+			profile->op_count[op] += __atomic_load_n(
+				&shard->op_count[op], __ATOMIC_RELAXED);
+			profile->op_bytes[op] += __atomic_load_n(
+				&shard->op_bytes[op], __ATOMIC_RELAXED);
+		}
+		for (int c = 0; c < HEAPH_SIZE_CLASSES; ++c) {
+			profile->size_hist[c] += __atomic_load_n(
+				&shard->size_hist[c], __ATOMIC_RELAXED);
+		}
+	}
+	int64_t peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+	profile->live_bytes = live > 0 ? live : 0;
+	profile->peak_bytes = peak > live ? (uint64_t)peak : profile->live_bytes;
+	return true;
+}
+
+void
+heaph_print_profile(void)
+{
+	static const char *op_names[HEAPH_OP_COUNT] = {
+		"malloc", "calloc", "realloc", "strdup", "getline",
+		"aligned", "free",
+	};
+	struct heaph_profile profile;
+	if (!heaph_get_profile(&profile)) {
+		printf("Heap profile is off, run with HHPROFILE=1\n");
+		return;
+	}
+	printf("Heap profile:\n");
+	printf("  live bytes: %llu\n", (unsigned long long)profile.live_bytes);
+	printf("  peak bytes: %llu\n", (unsigned long long)profile.peak_bytes);
+	printf("  allocated bytes: %llu\n",
+	       (unsigned long long)profile.alloc_bytes);
+	for (int op = 0; op < HEAPH_OP_COUNT; ++op) {
+		if (profile.op_count[op] == 0)
+			continue;
+		printf("  %s: %llu calls, %llu bytes\n", op_names[op],
+		       (unsigned long long)profile.op_count[op],
+		       (unsigned long long)profile.op_bytes[op]);
+	}
+	printf("  sizes:\n");
+	for (int c = 0; c < HEAPH_SIZE_CLASSES; ++c) {
+		if (profile.size_hist[c] == 0)
+			continue;
+		// Class c holds sizes up to 2^c - 1.
+		uint64_t max = c == 0 ? 0 : ((uint64_t)1 << (c - 1)) * 2 - 1;
+		printf("    <= %llu: %llu\n", (unsigned long long)max,
+		       (unsigned long long)profile.size_hist[c]);
+	}
+}
+
+// Print the biggest stacks by a field. Not thread-safe against itself, it
+// is done at exit or by hand.
+static void
+samples_print_top(const char *title, size_t field)
+{
+	static bool is_printed[HEAPH_STACK_COUNT];
+	memset(is_printed, 0, sizeof(is_printed));
+	printf("%s:\n", title);
+	for (int n = 0; n < HEAPH_SAMPLE_TOP; ++n) {
+		int best = -1;
+		int64_t best_value = 0;
+		for (int i = 0; i < HEAPH_STACK_COUNT; ++i) {
+			if (is_printed[i] ||
+			    !__atomic_load_n(&stacks[i].is_ready,
+					     __ATOMIC_ACQUIRE))
+				continue;
+			int64_t value = __atomic_load_n(
+				(int64_t *)((char *)&stacks[i] + field),
+				__ATOMIC_RELAXED);
+			if (value > best_value) {
+				best = i;
+				best_value = value;
+			}
+		}
+		if (best < 0)
+			break;
+		is_printed[best] = true;
+		struct heaph_stack *stack = &stacks[best];
+		printf("  ~%lld bytes, %llu samples, %lld live:\n",
+		       (long long)best_value,
+		       (unsigned long long)stack->sample_count,
+		       (long long)stack->live_count);
+		// Symbols are printed straight to the fd, without malloc().
+		fflush(stdout);
+		backtrace_symbols_fd(stack->frames, stack->depth, STDOUT_FILENO);
+	}
+}
+
+void
+heaph_print_samples(void)
+{
+	if (sample_interval <= 0) {
+		printf("Heap sampler is off, run with HHSAMPLE=<bytes>\n");
+		return;
+	}
+	// Buffers of the printing are not the app's, they are not sampled.
+	int64_t left = sample_left;
+	sample_left = INT64_MAX;
+	samples_print_top("Top allocating stacks",
+			  offsetof(struct heaph_stack, sample_bytes));
+	samples_print_top("Top leaking stacks",
+			  offsetof(struct heaph_stack, live_bytes));
+	sample_left = left;
+}
+
+int64_t
+heaph_get_sample_live_bytes(void)
+{
+	if (sample_interval <= 0)
+		return -1;
+	int64_t bytes = 0;
+	for (int i = 0; i < HEAPH_STACK_COUNT; ++i) {
+		if (__atomic_load_n(&stacks[i].is_ready, __ATOMIC_ACQUIRE))
+			bytes += __atomic_load_n(&stacks[i].live_bytes,
+						 __ATOMIC_RELAXED);
+	}
+	return bytes;
+}
+
+void
+heaph_print_times(void)
+{
+	static const char *op_names[HEAPH_OP_COUNT] = {
+		"malloc", "calloc", "realloc", "strdup", "getline",
+		"aligned", "free",
+	};
+	if (!is_time) {
+		printf("Heap timing is off, run with HHTIME=1\n");
+		return;
+	}
+	printf("Heap call times, ns:\n");
+	for (int op = 0; op < HEAPH_OP_COUNT; ++op) {
+		uint64_t count = 0, sum = 0, max = 0, slow = 0;
+		uint64_t hist[HEAPH_TIME_BUCKETS] = {0};
+		for (int i = 0; i < HEAPH_SHARD_COUNT; ++i) {
+			struct heaph_shard *shard = &shards[i];
+			count += __atomic_load_n(&shard->time_count[op],
+						 __ATOMIC_RELAXED);
+			sum += __atomic_load_n(&shard->time_sum[op],
+					       __ATOMIC_RELAXED);
+			slow += __atomic_load_n(&shard->time_slow[op],
+						__ATOMIC_RELAXED);
+			uint64_t m = __atomic_load_n(&shard->time_max[op],
+						     __ATOMIC_RELAXED);
+			max = m > max ? m : max;
+			for (int b = 0; b < HEAPH_TIME_BUCKETS; ++b) {
+				hist[b] += __atomic_load_n(
+					&shard->time_hist[op][b],
+					__ATOMIC_RELAXED);
+			}
+		}
+		if (count == 0)
+			continue;
+		// Percentiles are upper bounds of their power of 2 buckets.
+		uint64_t p50 = 0, p99 = 0, seen = 0;
+		for (int b = 0; b < HEAPH_TIME_BUCKETS; ++b) {
+			seen += hist[b];
+			uint64_t bound = b == 0 ? 0 : ((uint64_t)1 << b) - 1;
+			if (p50 == 0 && seen * 2 >= count)
+				p50 = bound;
+			if (seen * 100 >= count * 99) {
+				p99 = bound;
+				break;
+			}
+		}
+		p50 = p50 < max ? p50 : max;
+		p99 = p99 < max ? p99 : max;
+		printf("  %s: %llu calls, %.0f total, %.1f mean, <=%.0f p50, "
+		       "<=%.0f p99, %.0f max, %llu slow\n", op_names[op],
+		       (unsigned long long)count, sum / ticks_per_ns,
+		       sum / ticks_per_ns / count, p50 / ticks_per_ns,
+		       p99 / ticks_per_ns, max / ticks_per_ns,
+		       (unsigned long long)slow);
+	}
+	printf("  per thread:\n");
+	for (int i = 0; i < HEAPH_SHARD_COUNT; ++i) {
+		uint64_t count = 0, sum = 0;
+		for (int op = 0; op < HEAPH_OP_COUNT; ++op) {
+			count += __atomic_load_n(&shards[i].time_count[op],
+						 __ATOMIC_RELAXED);
+			sum += __atomic_load_n(&shards[i].time_sum[op],
+					       __ATOMIC_RELAXED);
+		}
+		if (count != 0) {
+			printf("    %d: %llu calls, %.0f total\n", i,
+			       (unsigned long long)count, sum / ticks_per_ns);
+		}
+	}
 }
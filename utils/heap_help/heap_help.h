@@ -1,6 +1,101 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 uint64_t
 heaph_get_alloc_count(void);
+
+// Allocations made since the start, and bytes asked by them. Unlike
+// heaph_get_alloc_count() they only grow, so a difference of two reads
+// is how much a piece of code allocates. A realloc() of an existing
+// block counts as an allocation of its new size.
+uint64_t
+heaph_get_alloc_total(void);
+
+uint64_t
+heaph_get_alloc_total_bytes(void);
+
+// Heap calls told apart by the profiler.
+enum heaph_op {
+	HEAPH_OP_MALLOC,
+	HEAPH_OP_CALLOC,
+	HEAPH_OP_REALLOC,
+	HEAPH_OP_STRDUP,
+	HEAPH_OP_GETLINE,
+	// aligned_alloc() and posix_memalign().
+	HEAPH_OP_ALIGNED,
+	HEAPH_OP_FREE,
+	HEAPH_OP_COUNT,
+};
+
+enum {
+	// Size class c holds sizes from 2^(c - 1) to 2^c - 1, class 0 is
+	// for 0 bytes.
+	HEAPH_SIZE_CLASSES = 65,
+};
+
+struct heaph_profile {
+	// Bytes are real block sizes, malloc_usable_size(), not asked ones.
+	uint64_t live_bytes;
+	uint64_t peak_bytes;
+	uint64_t alloc_bytes;
+	// Calls of each type and bytes they allocated, freed or resized by.
+	uint64_t op_count[HEAPH_OP_COUNT];
+	uint64_t op_bytes[HEAPH_OP_COUNT];
+	// Asked sizes of allocations.
+	uint64_t size_hist[HEAPH_SIZE_CLASSES];
+};
+
+// A trace file written with HHTRACE=<path> is a header and then records.
+// They are written by threads in chunks, so they are ordered by time only
+// within a thread. See hh_replay.c for a reader.
+#define HEAPH_TRACE_MAGIC "HHTRACE1"
+
+struct heaph_trace_header {
+	char magic[8];
+	uint64_t record_size;
+};
+
+struct heaph_trace_record {
+	// Nanoseconds since the start of the trace.
+	uint64_t time;
+	// Block returned by an allocation, or passed to free().
+	uint64_t ptr;
+	// Block passed to realloc(), or the alignment of HEAPH_OP_ALIGNED.
+	uint64_t old_ptr;
+	// enum heaph_op in the low 8 bits, thread number in the next 16,
+	// the asked size in the rest. A number of an exited thread is given
+	// to a new one. Threads past 65535 alive at once share the number
+	// 65535.
+	uint64_t info;
+};
+
+// Get the profiler numbers. Returns false and zeros if the profiler is off,
+// it is turned on by HHPROFILE=1.
+bool
+heaph_get_profile(struct heaph_profile *profile);
+
+// Print the profile to stdout. It is done at exit too when it is on.
+void
+heaph_print_profile(void);
+
+// Print the stacks which allocated most and which hold most not freed
+// memory, as estimated by the sampler. It is on with HHSAMPLE=<bytes>,
+// taking a stack about once per that many allocated bytes. It is done at
+// exit too when it is on.
+void
+heaph_print_samples(void);
+
+// Not freed bytes as estimated by the sampler, summed over all stacks.
+// -1 when the sampler is off.
+int64_t
+heaph_get_sample_live_bytes(void);
+
+// Print how long the allocator calls took: totals, percentiles, calls
+// slower than a threshold, and totals of each thread. It is on with
+// HHTIME=1, the threshold is HHTIME_SLOW=<ns>, 100us by default. It is
+// done at exit too when it is on. Threads past the 64th share the rows
+// with others.
+void
+heaph_print_times(void);
@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include "heap_help.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Replay of a heap_help trace, see HHTRACE in README.md. The calls are
+// made again in the order of their time, in one thread, against whatever
+// malloc() the tool is built or preloaded with. So the same trace can be
+// run against different allocators and compared.
+//
+// Build: gcc -O2 hh_replay.c -o hh_replay
+// Run: ./hh_replay trace.bin [-r repeat] [-w] [-t]
+//
+// -w writes all the allocated bytes, otherwise untouched pages of big
+// blocks do not count in the RSS.
+//
+// -t times each call, for means per function. A clock read costs about as
+// much as a malloc(), so it is measured first and subtracted, and the run
+// time is not comparable with one without -t.
+
+static const char *op_names[HEAPH_OP_COUNT] = {
+	"malloc", "calloc", "realloc", "strdup", "getline", "aligned", "free",
+};
+
+// Addresses of the trace mapped to the blocks of the replay. Open
+// addressing, key 0 is an empty slot, deleted slots are re-inserted.
+struct block_map {
+	uint64_t *keys;
+	void **values;
+	size_t capacity;
+	size_t count;
+};
+
+static inline size_t
+map_slot(const struct block_map *map, uint64_t key)
+{
+	return ((key >> 4) * 0x9e3779b97f4a7c15ULL) & (map->capacity - 1);
+}
+
+static void map_put(struct block_map *map, uint64_t key, void *value);
+
+static void
+map_grow(struct block_map *map)
+{
+	struct block_map old = *map;
+	map->capacity = old.capacity == 0 ? 1024 : old.capacity * 2;
+	map->keys = calloc(map->capacity, sizeof(*map->keys));
+	map->values = calloc(map->capacity, sizeof(*map->values));
+	map->count = 0;
+	for (size_t i = 0; i < old.capacity; ++i) {
+		if (old.keys[i] != 0)
+			map_put(map, old.keys[i], old.values[i]);
+	}
+	free(old.keys);
+	free(old.values);
+}
+
+static void
+map_put(struct block_map *map, uint64_t key, void *value)
+{
+	if ((map->count + 1) * 2 > map->capacity)
+		map_grow(map);
+	size_t i = map_slot(map, key);
+	while (map->keys[i] != 0)
+		i = (i + 1) & (map->capacity - 1);
+	map->keys[i] = key;
+	map->values[i] = value;
+	++map->count;
+}
+
+// Remove @a key and return its value, NULL if it is not there.
+static void *
+map_take(struct block_map *map, uint64_t key)
+{
+	if (map->capacity == 0)
+		return NULL;
+	size_t i = map_slot(map, key);
+	while (map->keys[i] != key) {
+		if (map->keys[i] == 0)
+			return NULL;
+		i = (i + 1) & (map->capacity - 1);
+	}
+	void *value = map->values[i];
+	map->keys[i] = 0;
+	--map->count;
+	// Close the gap, the following keys of the run are put again.
+	for (i = (i + 1) & (map->capacity - 1); map->keys[i] != 0;
+	     i = (i + 1) & (map->capacity - 1)) {
+		uint64_t k = map->keys[i];
+		void *v = map->values[i];
+		map->keys[i] = 0;
+		--map->count;
+		map_put(map, k, v);
+	}
+	return value;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Mean time of a now_ns() pair with nothing between, as seen by a call
+// timed with them.
+static double
+timer_cost_ns(void)
+{
+	enum { count = 100000 };
+	uint64_t total = 0;
+	for (int i = 0; i < count; ++i) {
+		uint64_t start = now_ns();
+		total += now_ns() - start;
+	}
+	return (double)total / count;
+}
+
+static int
+record_cmp(const void *a, const void *b)
+{
+	const struct heaph_trace_record *x = a, *y = b;
+	if (x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	// At the same time a free goes first, its block can be reused.
+	bool x_free = (x->info & 0xff) == HEAPH_OP_FREE;
+	bool y_free = (y->info & 0xff) == HEAPH_OP_FREE;
+	return (int)y_free - (int)x_free;
+}
+
+static struct heaph_trace_record *
+trace_read(const char *path, size_t *count)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+	struct heaph_trace_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, HEAPH_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.record_size != sizeof(struct heaph_trace_record)) {
+		fprintf(stderr, "%s: not a heap_help trace\n", path);
+		fclose(f);
+		return NULL;
+	}
+	size_t capacity = 1024;
+	size_t size = 0;
+	struct heaph_trace_record *records = malloc(capacity * sizeof(*records));
+	size_t rc;
+	while ((rc = fread(records + size, sizeof(*records), capacity - size,
+			   f)) > 0) {
+		size += rc;
+		if (size == capacity) {
+			capacity *= 2;
+			records = realloc(records, capacity * sizeof(*records));
+		}
+	}
+	fclose(f);
+	// Threads write their records in chunks, the order is restored here.
+	qsort(records, size, sizeof(*records), record_cmp);
+	*count = size;
+	return records;
+}
+
+struct replay_stats {
+	uint64_t op_count[HEAPH_OP_COUNT];
+	// Only with -t, timer cost included.
+	uint64_t op_ns[HEAPH_OP_COUNT];
+	// Frees of blocks not in the map, and allocations of addresses
+	// which are in it. Both come from races between threads around
+	// the same address, which the merged order can not resolve.
+	uint64_t lost_count;
+};
+
+static void
+replay(const struct heaph_trace_record *records, size_t count,
+       bool is_write, bool is_timed, struct replay_stats *stats)
+{
+	struct block_map map = {0};
+	for (size_t i = 0; i < count; ++i) {
+		const struct heaph_trace_record *rec = &records[i];
+		int op = rec->info & 0xff;
+		size_t size = rec->info >> 24;
+		void *res = NULL;
+		uint64_t start = is_timed ? now_ns() : 0;
+		switch (op) {
+		case HEAPH_OP_FREE:
+			res = map_take(&map, rec->ptr);
+			if (res == NULL)
+				++stats->lost_count;
+			free(res);
+			break;
+		case HEAPH_OP_REALLOC: {
+			void *old = rec->old_ptr != 0 ?
+				    map_take(&map, rec->old_ptr) : NULL;
+			if (old == NULL && rec->old_ptr != 0)
+				++stats->lost_count;
+			res = realloc(old, size);
+			break;
+		}
+		case HEAPH_OP_CALLOC:
+			res = calloc(1, size);
+			break;
+		case HEAPH_OP_ALIGNED:
+			if (posix_memalign(&res, rec->old_ptr, size) != 0)
+				res = NULL;
+			break;
+		default:
+			res = malloc(size);
+			break;
+		}
+		stats->op_count[op]++;
+		if (is_timed)
+			stats->op_ns[op] += now_ns() - start;
+		if (op == HEAPH_OP_FREE || res == NULL)
+			continue;
+		if (is_write)
+			memset(res, 0xab, size);
+		void *old = map_take(&map, rec->ptr);
+		if (old != NULL) {
+			++stats->lost_count;
+			free(old);
+		}
+		map_put(&map, rec->ptr, res);
+	}
+	// Leaks of the traced program are freed, so as repeats do not pile
+	// them up.
+	for (size_t i = 0; i < map.capacity; ++i) {
+		if (map.keys[i] != 0)
+			free(map.values[i]);
+	}
+	free(map.keys);
+	free(map.values);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *path = NULL;
+	int repeat = 1;
+	bool is_write = false;
+	bool is_timed = false;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			repeat = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-w") == 0)
+			is_write = true;
+		else if (strcmp(argv[i], "-t") == 0)
+			is_timed = true;
+		else
+			path = argv[i];
+	}
+	if (path == NULL || repeat <= 0) {
+		fprintf(stderr, "usage: %s trace [-r repeat] [-w] [-t]\n", argv[0]);
+		return 1;
+	}
+	size_t count;
+	struct heaph_trace_record *records = trace_read(path, &count);
+	if (records == NULL)
+		return 1;
+	double timer_ns = is_timed ? timer_cost_ns() : 0;
+	struct replay_stats stats = {0};
+	uint64_t start = now_ns();
+	for (int i = 0; i < repeat; ++i)
+		replay(records, count, is_write, is_timed, &stats);
+	double sec = (now_ns() - start) / 1e9;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	// Bytes on Mac, kilobytes on Linux.
+	usage.ru_maxrss /= 1024;
+#endif
+	printf("records: %zu, repeats: %d\n", count, repeat);
+	printf("time: %.6f s, %.1f ns per call\n", sec,
+	       count == 0 ? 0 : sec * 1e9 / count / repeat);
+	printf("peak RSS: %ld KB\n", usage.ru_maxrss);
+	if (is_timed)
+		printf("timer cost: %.1f ns, subtracted\n", timer_ns);
+	for (int op = 0; op < HEAPH_OP_COUNT; ++op) {
+		if (stats.op_count[op] == 0)
+			continue;
+		printf("  %s: %llu calls", op_names[op],
+		       (unsigned long long)stats.op_count[op]);
+		if (is_timed) {
+			double mean = (double)stats.op_ns[op] /
+				      stats.op_count[op] - timer_ns;
+			printf(", %.1f ns mean", mean > 0 ? mean : 0);
+		}
+		printf("\n");
+	}
+	if (stats.lost_count != 0) {
+		printf("not matched: %llu\n",
+		       (unsigned long long)stats.lost_count);
+	}
+	free(records);
+	return 0;
+}
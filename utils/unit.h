@@ -3,6 +3,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 #define unit_test_start() \
 	printf("\t-------- %s started --------\n", __func__)
@@ -31,3 +39,277 @@
 		printf("ok - %s\n", (msg));				\
 	}								\
 })
+
+/*
+ * Allocation budgets. They work when heap_help is built into the
+ * test, otherwise the checks are skipped. The symbols are weak, so
+ * the tests build without it as well.
+ */
+uint64_t heaph_get_alloc_count(void) __attribute__((weak));
+uint64_t heaph_get_alloc_total(void) __attribute__((weak));
+uint64_t heaph_get_alloc_total_bytes(void) __attribute__((weak));
+
+#define unit_alloc_is_tracked() (heaph_get_alloc_total != NULL)
+
+/* Estimate of the heap_help sampler, -1 when it is off. */
+int64_t heaph_get_sample_live_bytes(void) __attribute__((weak));
+
+/*
+ * Run the code given after @a msg and check that it makes not more
+ * than @a max_count allocations and asks not more than @a max_bytes.
+ */
+#define unit_check_alloc_budget(max_count, max_bytes, msg, ...) ({	\
+	bool unit_tracked = unit_alloc_is_tracked();			\
+	uint64_t unit_count = unit_tracked ? heaph_get_alloc_total() : 0; \
+	uint64_t unit_bytes = unit_tracked ?				\
+			      heaph_get_alloc_total_bytes() : 0;	\
+	__VA_ARGS__;							\
+	if (unit_tracked) {						\
+		unit_count = heaph_get_alloc_total() - unit_count;	\
+		unit_bytes = heaph_get_alloc_total_bytes() - unit_bytes; \
+		if (unit_count > (uint64_t)(max_count) ||		\
+		    unit_bytes > (uint64_t)(max_bytes)) {		\
+			unit_msg("%llu allocations, %llu bytes",	\
+				 (unsigned long long)unit_count,	\
+				 (unsigned long long)unit_bytes);	\
+		}							\
+		unit_check(unit_count <= (uint64_t)(max_count) &&	\
+			   unit_bytes <= (uint64_t)(max_bytes), (msg));	\
+	} else {							\
+		printf("ok - %s # skip, no heap_help\n", (msg));	\
+	}								\
+})
+
+/* The same with any number of bytes, only allocations are counted. */
+#define unit_check_alloc_count(max_count, msg, ...)			\
+	unit_check_alloc_budget(max_count, UINT64_MAX, msg, __VA_ARGS__)
+
+/*
+ * Microbenchmarks. unit_bench() runs the code given after the name
+ * in a loop: first it finds an iteration count which takes about
+ * UNIT_BENCH_SAMPLE_NS, then runs it for UNIT_BENCH_WARMUP_NS, then
+ * takes UNIT_BENCH_SAMPLES timed samples. Min, median and max per
+ * iteration are printed as a comment line, and the median in
+ * nanoseconds is the value of the macro. The samples are few for
+ * percentiles of the tail, so the slowest one is given as is.
+ *
+ * Environment:
+ * UNIT_BENCH_PERF=1 - count cycles and instructions too, by
+ *     perf_event_open(). Skipped silently where it is not allowed.
+ * UNIT_BENCH_JSON=<path> - append a JSON line per benchmark to the
+ *     file, "-" for stdout.
+ *
+ * The limits can be redefined before the header is included.
+ */
+#ifndef UNIT_BENCH_SAMPLES
+#define UNIT_BENCH_SAMPLES 30
+#endif
+#ifndef UNIT_BENCH_SAMPLE_NS
+#define UNIT_BENCH_SAMPLE_NS 2000000
+#endif
+#ifndef UNIT_BENCH_WARMUP_NS
+#define UNIT_BENCH_WARMUP_NS 20000000
+#endif
+
+enum {
+	UNIT_BENCH_CALIBRATE,
+	UNIT_BENCH_WARMUP,
+	UNIT_BENCH_MEASURE,
+};
+
+struct unit_bench {
+	const char *name;
+	/* Iterations per sample. */
+	uint64_t iters;
+	int phase;
+	uint64_t phase_start;
+	uint64_t start;
+	int sample_count;
+	/* Nanoseconds per iteration of each sample. */
+	double samples[UNIT_BENCH_SAMPLES];
+	/* Cycles and instructions, -1 if not counted. */
+	int perf_fd[2];
+	uint64_t perf_start[2];
+	uint64_t perf_sum[2];
+	double median;
+};
+
+static inline uint64_t
+unit_bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Do not let the compiler drop a computed value. */
+#define unit_bench_keep(value) __asm__ volatile("" : : "g"(value) : "memory")
+
+static inline void
+unit_bench_perf_open(struct unit_bench *b)
+{
+	b->perf_fd[0] = -1;
+	b->perf_fd[1] = -1;
+#ifdef __linux__
+	const char *env = getenv("UNIT_BENCH_PERF");
+	if (env == NULL || strcmp(env, "1") != 0)
+		return;
+	const uint64_t configs[2] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+	};
+	for (int i = 0; i < 2; ++i) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = configs[i];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		b->perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+#endif
+}
+
+static inline uint64_t
+unit_bench_perf_read(int fd)
+{
+	uint64_t value = 0;
+	if (fd >= 0 && read(fd, &value, sizeof(value)) != sizeof(value))
+		value = 0;
+	return value;
+}
+
+static inline void
+unit_bench_init(struct unit_bench *b, const char *name)
+{
+	memset(b, 0, sizeof(*b));
+	b->name = name;
+	b->iters = 1;
+	b->phase = UNIT_BENCH_CALIBRATE;
+	unit_bench_perf_open(b);
+}
+
+/*
+ * Close the previous sample and start the next one. Returns false
+ * when all the samples are taken.
+ */
+static inline bool
+unit_bench_next(struct unit_bench *b)
+{
+	uint64_t now = unit_bench_now();
+	uint64_t elapsed = now - b->start;
+	switch (b->phase) {
+	case UNIT_BENCH_CALIBRATE:
+		if (b->start == 0) {
+			break;
+		} else if (elapsed < UNIT_BENCH_SAMPLE_NS) {
+			b->iters *= 2;
+		} else {
+			b->phase = UNIT_BENCH_WARMUP;
+			b->phase_start = now;
+		}
+		break;
+	case UNIT_BENCH_WARMUP:
+		if (now - b->phase_start >= UNIT_BENCH_WARMUP_NS)
+			b->phase = UNIT_BENCH_MEASURE;
+		break;
+	default:
+		for (int i = 0; i < 2; ++i) {
+			b->perf_sum[i] += unit_bench_perf_read(b->perf_fd[i]) -
+					  b->perf_start[i];
+		}
+		b->samples[b->sample_count++] = (double)elapsed / b->iters;
+		if (b->sample_count == UNIT_BENCH_SAMPLES)
+			return false;
+		break;
+	}
+	for (int i = 0; i < 2; ++i)
+		b->perf_start[i] = unit_bench_perf_read(b->perf_fd[i]);
+	b->start = unit_bench_now();
+	return true;
+}
+
+/* Print @a str as a JSON string, quoted and escaped. */
+static inline void
+unit_bench_json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str != 0; ++str) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static inline int
+unit_bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Print the results, release the counters. Returns the median. */
+static inline double
+unit_bench_finish(struct unit_bench *b)
+{
+	int n = b->sample_count;
+	qsort(b->samples, n, sizeof(b->samples[0]), unit_bench_cmp);
+	double sum = 0;
+	for (int i = 0; i < n; ++i)
+		sum += b->samples[i];
+	double min = b->samples[0];
+	double max = b->samples[n - 1];
+	b->median = b->samples[n / 2];
+	double total = (double)b->iters * n;
+	double per_iter[2];
+	for (int i = 0; i < 2; ++i) {
+		per_iter[i] = b->perf_fd[i] >= 0 ? b->perf_sum[i] / total : -1;
+		if (b->perf_fd[i] >= 0)
+			close(b->perf_fd[i]);
+	}
+	if (per_iter[0] >= 0 && per_iter[1] >= 0) {
+		unit_msg("bench %s: %llu iters x %d, min %.1f ns, median %.1f "
+			 "ns, max %.1f ns, %.1f cycles, %.1f instructions",
+			 b->name, (unsigned long long)b->iters, n, min,
+			 b->median, max, per_iter[0], per_iter[1]);
+	} else {
+		unit_msg("bench %s: %llu iters x %d, min %.1f ns, median %.1f "
+			 "ns, max %.1f ns", b->name,
+			 (unsigned long long)b->iters, n, min, b->median, max);
+	}
+	const char *path = getenv("UNIT_BENCH_JSON");
+	if (path == NULL)
+		return b->median;
+	FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "a");
+	if (f == NULL)
+		return b->median;
+	fprintf(f, "{\"bench\": ");
+	unit_bench_json_string(f, b->name);
+	fprintf(f, ", \"iters\": %llu, \"samples\": %d, \"min_ns\": %.2f, "
+		"\"median_ns\": %.2f, \"max_ns\": %.2f, \"mean_ns\": %.2f",
+		(unsigned long long)b->iters, n, min, b->median, max, sum / n);
+	if (per_iter[0] >= 0)
+		fprintf(f, ", \"cycles\": %.2f", per_iter[0]);
+	if (per_iter[1] >= 0)
+		fprintf(f, ", \"instructions\": %.2f", per_iter[1]);
+	fprintf(f, "}\n");
+	if (f != stdout)
+		fclose(f);
+	return b->median;
+}
+
+#define unit_bench(name, ...) ({					\
+	struct unit_bench unit_b;					\
+	unit_bench_init(&unit_b, (name));				\
+	while (unit_bench_next(&unit_b)) {				\
+		for (uint64_t unit_i = 0; unit_i < unit_b.iters; ++unit_i) { \
+			__VA_ARGS__;					\
+		}							\
+	}								\
+	unit_bench_finish(&unit_b);					\
+})